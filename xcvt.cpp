@@ -1,19 +1,69 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 constexpr double PROGRAM_VERSION{0.7};
 
+// Goes into plan_key: bump it whenever the factor tables or the output
+// format change, so caches and checkpoints from older builds are not
+// reused. 2: exact imperial factors. 3: cache entries carry skip counts.
+constexpr int kPlanRevision = 3;
+
 std::unordered_map<std::string, double> length_factors{
-    {"m", 1.0},     {"cm", 0.01}, {"mm", 0.001},  {"ft", 0.3048},
-    {"yd", 0.9144}, {"km", 1000}, {"mi", 1609.34}};
+    {"m", 1.0},     {"cm", 0.01},   {"mm", 0.001}, {"in", 0.0254},
+    {"ft", 0.3048}, {"yd", 0.9144}, {"km", 1000},  {"mi", 1609.344}};
 
+// Imperial factors are the exact definitions, so that 16 oz is exactly 1 lb
+// and mixed quantities split back into whole units.
 std::unordered_map<std::string, double> mass_factors{
-    {"kg", 1.0}, {"g", 0.001}, {"lb", 0.453592}, {"oz", 0.0283495}};
+    {"kg", 1.0}, {"g", 0.001}, {"lb", 0.45359237}, {"oz", 0.028349523125}};
 
 std::unordered_map<std::string, double> volume_factors{
     {"L", 1.0},       // liter
@@ -23,20 +73,20 @@ std::unordered_map<std::string, double> volume_factors{
     {"uL", 0.000001}, // microliter
     {"ul", 0.000001}, // lowercase alias
 
-    {"gal", 3.78541},    // US gallon
-    {"qt", 0.946353},    // US quart
-    {"pt", 0.473176},    // US pint
-    {"cup", 0.24},       // metric cup
-    {"floz", 0.0295735}, // US fluid ounce
+    {"gal", 3.785411784},      // US gallon
+    {"qt", 0.946352946},       // US quart
+    {"pt", 0.473176473},       // US pint
+    {"cup", 0.24},             // metric cup
+    {"floz", 0.0295735295625}, // US fluid ounce
 
-    {"tbsp", 0.0147868}, // tablespoon
-    {"tsp", 0.00492892}, // teaspoon
+    {"tbsp", 0.01478676478125}, // tablespoon
+    {"tsp", 0.00492892159375},  // teaspoon
 
-    {"m3", 1000.0},     // cubic meter
-    {"cm3", 0.001},     // cubic centimeter = milliliter
-    {"cc", 0.001},      // cc (same as mL)
-    {"in3", 0.0163871}, // cubic inch
-    {"ft3", 28.3168},   // cubic foot
+    {"m3", 1000.0},        // cubic meter
+    {"cm3", 0.001},        // cubic centimeter = milliliter
+    {"cc", 0.001},         // cc (same as mL)
+    {"in3", 0.016387064},  // cubic inch
+    {"ft3", 28.316846592}, // cubic foot
 };
 
 struct TempUnit {
@@ -76,6 +126,8 @@ std::unordered_map<std::string, std::string> unit_aliases = {
     {"kilometers", "km"},
     {"kilometre", "km"},
     {"kilometres", "km"},
+    {"inch", "in"},
+    {"inches", "in"},
     {"foot", "ft"},
     {"feet", "ft"},
     {"yard", "yd"},
@@ -121,28 +173,354 @@ std::unordered_map<std::string, std::string> unit_aliases = {
 };
 
 void print_usage() {
-    std::cout << "Usage: convert -f <from_unit> -t <to_unit> <value>\n"
+    std::cout << "Usage: convert -f <from_unit> -t <to_unit> <value>...\n"
                  "Options:\n"
                  "  -h, --help        Show this help message\n"
                  "  -l, --list        List supported units\n"
+                 "  --                Take the rest as values (e.g. -- -63)\n"
+                 "\n"
+                 "Tables:\n"
+                 "  --range A:B:STEP       Print a table from A to B; "
+                 "repeat -t for more columns\n"
+                 "  --fixed N              Print converted values with N "
+                 "decimals (max 9)\n"
+                 "  --auto                 Print results in the unit "
+                 "that reads best (mm..km, ...)\n"
+                 "  --split UNITS          Write results as whole units, "
+                 "e.g. ft,in or lb,oz\n"
+                 "  -a, --all              Convert the values into every "
+                 "unit of -f's kind\n"
+                 "\n"
+                 "Expressions (values may also carry units: 5km, 5 ft 3 "
+                 "in):\n"
+                 "  'EXPR [in UNIT]'       Evaluate e.g. '3 km + 200 m - "
+                 "0.5 mi in ft'\n"
+                 "  '$1 lb + $2 oz in kg'  Apply to every row; $N is "
+                 "column N\n"
+                 "  --repl                 Answer one query per input line "
+                 "(-f/-t optional)\n"
+                 "\n"
+                 "Batch conversion (when no value is given, one row per "
+                 "line):\n"
+                 "  -i, --input FILE       Read rows from FILE "
+                 "(default stdin)\n"
+                 "  -o, --output FILE      Write results to FILE "
+                 "(default stdout)\n"
+                 "  --cache DIR            Reuse output of unchanged "
+                 "chunks from DIR\n"
+                 "  --checkpoint           Save progress to OUTPUT.ckpt "
+                 "(needs -i and -o)\n"
+                 "  --checkpoint-every S   Seconds between checkpoints "
+                 "(default 10)\n"
+                 "  --resume               Continue from OUTPUT.ckpt\n"
+                 "  --recursive DIR        Convert every file under DIR "
+                 "into -o/--out DIR\n"
+                 "  --on-error MODE        Bad rows: skip (default), nan, "
+                 "or reject:FILE\n"
+                 "  --max-errors N         Stop once more than N rows "
+                 "fail\n"
+                 "  --memo                 Reuse the output of repeated "
+                 "rows (quantized data)\n"
+                 "  --format FMT           Write rows as text (default), "
+                 "csv, tsv, jsonl,\n"
+                 "                         fixed (32-byte records) or "
+                 "binary (doubles)\n"
+                 "\n"
+                 "Sharding (shards are numbered from 0):\n"
+                 "  --shard I/N            Only process shard I of N of "
+                 "the input\n"
+                 "  --write-index          Write INPUT.idx line offsets "
+                 "for sharding\n"
+                 "  --merge MODE FILE...   Combine shard results: concat, "
+                 "groups, sketches\n"
+                 "                         or spool (FILE is a spool "
+                 "directory)\n"
+                 "  --spool DIR            Share the work on -i through "
+                 "leases in DIR\n"
+                 "  --chunk-size MB        Spool chunk size (default 64)\n"
+                 "  --lease S              Seconds before an idle lease is "
+                 "reclaimed (default 60)\n"
+                 "\n"
+                 "UDP telemetry (datagrams of 'CHANNEL VALUE' lines):\n"
+                 "  --listen-udp PORT      Convert datagrams received on "
+                 "PORT\n"
+                 "  --channel NAME=FROM:TO Plan for one channel "
+                 "(repeatable; -f/-t for the rest)\n"
+                 "  --udp-sockets N        SO_REUSEPORT sockets, one "
+                 "thread each (default 1)\n"
+                 "  --forward HOST:PORT    Send converted datagrams "
+                 "instead of writing -o\n"
+                 "\n"
+                 "Stream statistics (values read from stdin, one per line):\n"
+                 "  --stats                Summarize converted values\n"
+                 "  -q, --quantiles LIST   Quantiles to report "
+                 "(default 0.5,0.9,0.99)\n"
+                 "  --hist                 Print a log-linear histogram\n"
+                 "  --save-sketch FILE     Write the merged sketch to FILE\n"
+                 "  --merge-sketch FILE    Fold a saved sketch into the "
+                 "result\n"
+                 "  -j, --jobs N           Worker threads (default: all "
+                 "cores)\n"
+                 "  --cpu LEVEL            Kernels: auto (default), scalar, "
+                 "avx2, avx512\n"
+                 "  --round-size MB        Convert batch input this much "
+                 "at a time\n"
+                 "  --autotune             Time a sample of the rows and "
+                 "save the fastest\n"
+                 "                         -j/--round-size/--cpu as this "
+                 "machine's profile\n"
+                 "\n"
+                 "Delimited rows:\n"
+                 "  -d, --delimiter C      Column delimiter (default ',')\n"
+                 "  --value-col N          Column holding the value "
+                 "(default 1)\n"
+                 "  --unit-col N           Column holding each row's "
+                 "unit (replaces -f)\n"
+                 "  --records              Rows are 'VALUE FROM TO' "
+                 "(replaces -f and -t)\n"
+                 "  -0, --null             Rows end with NUL instead of "
+                 "newline\n"
+                 "  --group-by N           Total converted values per "
+                 "key in column N\n"
+                 "  --spill-groups N       Groups per worker before "
+                 "spilling to disk\n"
+                 "\n"
+                 "Windows (timestamps in seconds, durations like 30s, 1m, "
+                 "1h):\n"
+                 "  --time-col N           Column holding the timestamp\n"
+                 "  --window DUR           Emit per-window totals as "
+                 "windows close\n"
+                 "  --slide DUR            Window step (default: tumbling)\n"
+                 "  --lateness DUR         Out-of-order tolerance "
+                 "(default 0)\n"
+                 "\n"
+                 "Follow mode:\n"
+                 "  --follow FILE          Convert FILE, then keep "
+                 "converting appended lines\n"
+                 "  --state FILE           Persist the read offset to "
+                 "resume after restart\n"
               << std::endl;
 }
 
 enum class UnitCategory { Length, Mass, Volume, Tempurature, Unknown };
 
+// Why a value could not be converted. The conversion core hands these back
+// in an Expected instead of throwing, so a bad row costs a return rather
+// than an unwind; the throwing convert()/make_plan() are thin wrappers for
+// the command line.
+enum class ConvertError { BadNumber, UnknownUnit, WrongKind, ShortRow };
+constexpr size_t kConvertErrors = 4;
+
+const char *describe(ConvertError error) {
+    switch (error) {
+    case ConvertError::BadNumber:
+        return "bad number";
+    case ConvertError::UnknownUnit:
+        return "unknown unit";
+    case ConvertError::WrongKind:
+        return "incompatible units";
+    case ConvertError::ShortRow:
+        return "missing column";
+    }
+    return "error";
+}
+
+struct ConvertFailure {
+    ConvertError code{ConvertError::BadNumber};
+    std::string_view context; // the offending text, owned by the caller
+};
+
+// A value or the reason there is none.
+template <typename T> class Expected {
+  public:
+    Expected(T value) : value_(std::move(value)), ok_(true) {}
+    Expected(ConvertFailure failure) : failure_(failure) {}
+
+    explicit operator bool() const { return ok_; }
+    const T &operator*() const { return value_; }
+    const T *operator->() const { return &value_; }
+    const ConvertFailure &error() const { return failure_; }
+
+  private:
+    T value_{};
+    ConvertFailure failure_;
+    bool ok_{false};
+};
+
+// What to do with a row that cannot be converted (`--on-error`).
+enum class OnError { Skip, Nan, Reject };
+
+// How converted rows are written (`--format`); see RowWriter.
+enum class OutputFormat { Text, Csv, Tsv, Jsonl, Fixed, Binary };
+
+// Bad rows seen so far, by reason, plus the rows themselves when they go
+// to a reject file.
+struct RowErrors {
+    std::array<uint64_t, kConvertErrors> counts{};
+    std::string rejected;
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (uint64_t count : counts) {
+            sum += count;
+        }
+        return sum;
+    }
+
+    void add(ConvertError why, std::string_view row, OnError policy) {
+        ++counts[static_cast<size_t>(why)];
+        if (policy == OnError::Reject) {
+            rejected.append(row.data(), row.size());
+            rejected += '\n';
+        }
+    }
+
+    void merge(const RowErrors &other) {
+        for (size_t i = 0; i < kConvertErrors; ++i) {
+            counts[i] += other.counts[i];
+        }
+        rejected += other.rejected;
+    }
+
+    // `--max-errors`: called between chunks, never per row.
+    void check(uint64_t limit) const {
+        if (total() > limit) {
+            throw std::runtime_error("Giving up after " +
+                                     std::to_string(total()) +
+                                     " bad row(s).");
+        }
+    }
+
+    // e.g. "Skipped 3 row(s): 2 bad number, 1 unknown unit".
+    void report(std::ostream &out, OnError policy = OnError::Skip) const {
+        if (total() == 0) {
+            return;
+        }
+        out << (policy == OnError::Nan      ? "Wrote nan for "
+                : policy == OnError::Reject ? "Rejected "
+                                            : "Skipped ")
+            << total() << " row(s):";
+        const char *sep = " ";
+        for (size_t i = 0; i < kConvertErrors; ++i) {
+            if (counts[i] > 0) {
+                out << sep << counts[i] << ' '
+                    << describe(static_cast<ConvertError>(i));
+                sep = ", ";
+            }
+        }
+        out << '\n';
+    }
+};
+
 struct ConversionRule {
     std::string from_unit;
     std::string to_unit;
     std::function<double(double)> convert;
 };
 
+// Which delimited columns (1-based, 0 = absent) hold the value, its unit and
+// the group-by key.
+struct RowLayout {
+    char delimiter{','};
+    size_t value_col{1};
+    size_t unit_col{0};
+    size_t group_col{0};
+    size_t time_col{0};
+
+    // `VALUE FROM TO` records instead of columns, ended by `separator`.
+    bool records{false};
+    char separator{'\n'};
+
+    // Rescale each result into a readable unit (`--auto`), or write it as
+    // whole counts of a unit list such as "ft,in" (`--split`).
+    bool auto_scale{false};
+    std::string split;
+
+    // Column template such as "$1 lb + $2 oz in kg" (replaces the value
+    // and unit columns).
+    std::string expression;
+
+    // Bad rows: dropped, written as "nan" in place, or kept for a reject
+    // file; more than `max_errors` of them stops the job.
+    OnError on_error{OnError::Skip};
+    uint64_t max_errors{std::numeric_limits<uint64_t>::max()};
+
+    OutputFormat format{OutputFormat::Text};
+
+    // Reuse the output of rows seen before (`--memo`, plain rows only).
+    bool memo{false};
+};
+
+struct WindowOptions {
+    double size{0.0};     // seconds; 0 disables windowing
+    double slide{0.0};    // equal to size for tumbling windows
+    double lateness{0.0}; // how far behind the newest row a row may arrive
+};
+
+// Which slice of the input this process owns: shard `index` of `count`.
+struct ShardSpec {
+    size_t index{0};
+    size_t count{1};
+};
+
 struct Args {
     std::string from_unit;
     std::string to_unit;
-    double value;
+    std::vector<std::string> to_units; // every -t, in order
+    std::vector<double> values;
     bool show_help{false};
     bool list_units{false};
     bool show_version{false};
+
+    bool stats{false};
+    bool show_histogram{false};
+    std::vector<double> quantiles{0.5, 0.9, 0.99};
+    std::string sketch_out;
+    std::vector<std::string> sketch_in;
+    unsigned jobs{0}; // 0 = one per hardware thread
+
+    RowLayout layout;
+    size_t spill_groups{1 << 20};
+    WindowOptions window;
+    std::string follow_path;
+    std::string state_path;
+
+    bool batch{false};
+    std::string input_path;
+    std::string output_path;
+    std::string cache_dir;
+    bool checkpoint{false};
+    double checkpoint_interval{10.0};
+    bool resume{false};
+
+    ShardSpec shard;
+    bool write_index{false};
+    std::string merge_mode;
+    std::vector<std::string> merge_files;
+
+    std::string spool_dir;
+    size_t chunk_size{64 << 20};
+    double lease_seconds{60.0};
+
+    std::string recursive_dir;
+    std::string reject_path; // --on-error reject:FILE
+
+    int udp_port{0};
+    unsigned udp_sockets{1};
+    std::vector<std::string> channels;
+    std::string forward;
+
+    std::string range;
+    int fixed_decimals{-1}; // -1 = general format
+    bool all_units{false};
+    bool repl{false};
+    std::string cpu{"auto"}; // kernel level, see bind_kernels()
+    size_t batch_round{0};   // bytes per batch round; 0 = profile or all
+    bool autotune{false};
+
+    // Values written with their units ("5 ft 3 in"), resolved in main();
+    // values[first] is a placeholder until then.
+    std::vector<std::pair<size_t, std::string>> quantities;
 };
 
 UnitCategory get_unit_category(std::string unit) {
@@ -179,18 +557,75 @@ std::string normalize_unit(std::string u) {
     return u;
 }
 
+// Parses a duration such as "90", "1.5s", "5m" or "1h" into seconds.
+double parse_duration(const std::string &text) {
+    size_t used = 0;
+    double seconds = std::stod(text, &used);
+    std::string suffix = text.substr(used);
+    if (suffix == "m") {
+        seconds *= 60;
+    } else if (suffix == "h") {
+        seconds *= 3600;
+    } else if (suffix == "d") {
+        seconds *= 86400;
+    } else if (!suffix.empty() && suffix != "s") {
+        throw std::invalid_argument("Unknown duration suffix '" + suffix +
+                                    "'.");
+    }
+    return seconds;
+}
+
 Args parse_args(int argc, char *argv[]) {
     // Argument handling
     Args result;
     bool have_from{false};
     bool have_to{false};
     bool have_value{false};
+    bool have_number{false};
+    bool options_done{false}; // after "--", e.g. for negative values
+
+    // Anything that is not an option: a --merge file, a row template, or a
+    // value (a number, or a quantity or expression with units).
+    auto positional = [&](const std::string &arg) {
+        if (!result.merge_mode.empty()) {
+            // After --merge, anything that is not an option is a file.
+            result.merge_files.push_back(arg);
+        } else if (arg.find('$') != std::string::npos) {
+            result.layout.expression = arg;
+        } else {
+            size_t used = 0;
+            double value = 0.0;
+            try {
+                value = std::stod(arg, &used);
+            } catch (const std::exception &) {
+            }
+            if (used == arg.size()) {
+                have_number = true;
+            } else {
+                result.quantities.emplace_back(result.values.size(), arg);
+            }
+            result.values.push_back(value);
+            have_value = true;
+        }
+    };
 
     for (int i = 1; i < argc; ++i) {
 
         std::string arg = argv[i];
 
-        if (arg == "-h" || arg == "--help") {
+        auto flag_value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::runtime_error("'" + arg +
+                                         "' flag requires a value.");
+            }
+            return argv[++i];
+        };
+
+        if (options_done) {
+            positional(arg);
+        } else if (arg == "--") {
+            options_done = true;
+        } else if (arg == "-h" || arg == "--help") {
             result.show_help = true;
         } else if (arg == "-l" || arg == "--list" || arg == "--units") {
             result.list_units = true;
@@ -211,25 +646,439 @@ Args parse_args(int argc, char *argv[]) {
                     throw std::runtime_error("'-t/--to' flag requires a unit.");
                 }
                 result.to_unit = normalize_unit(argv[++i]);
+                result.to_units.push_back(result.to_unit);
                 have_to = true;
             }
+        } else if (arg == "--stats") {
+            result.stats = true;
+        } else if (arg == "--hist") {
+            result.stats = true;
+            result.show_histogram = true;
+        } else if (arg == "-q" || arg == "--quantiles") {
+            result.quantiles.clear();
+            std::string list = flag_value();
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                if (comma == std::string::npos) {
+                    comma = list.size();
+                }
+                double q = std::stod(list.substr(start, comma - start));
+                if (q < 0.0 || q > 1.0) {
+                    throw std::invalid_argument(
+                        "Quantiles must be between 0 and 1.");
+                }
+                result.quantiles.push_back(q);
+                start = comma + 1;
+            }
+            result.stats = true;
+        } else if (arg == "--save-sketch") {
+            result.sketch_out = flag_value();
+            result.stats = true;
+        } else if (arg == "--merge-sketch") {
+            result.sketch_in.push_back(flag_value());
+            result.stats = true;
+        } else if (arg == "-d" || arg == "--delimiter") {
+            std::string delimiter = flag_value();
+            if (delimiter == "\\t" || delimiter == "tab") {
+                delimiter = "\t";
+            }
+            if (delimiter.size() != 1) {
+                throw std::invalid_argument(
+                    "Delimiter must be a single character.");
+            }
+            result.layout.delimiter = delimiter[0];
+        } else if (arg == "--value-col" || arg == "--unit-col" ||
+                   arg == "--group-by") {
+            int col = std::stoi(flag_value());
+            if (col < 1) {
+                throw std::invalid_argument("Columns are numbered from 1.");
+            }
+            if (arg == "--value-col") {
+                result.layout.value_col = static_cast<size_t>(col);
+            } else if (arg == "--unit-col") {
+                result.layout.unit_col = static_cast<size_t>(col);
+                have_from = true;
+            } else {
+                result.layout.group_col = static_cast<size_t>(col);
+            }
+        } else if (arg == "--time-col") {
+            int col = std::stoi(flag_value());
+            if (col < 1) {
+                throw std::invalid_argument("Columns are numbered from 1.");
+            }
+            result.layout.time_col = static_cast<size_t>(col);
+        } else if (arg == "--window") {
+            result.window.size = parse_duration(flag_value());
+        } else if (arg == "--slide") {
+            result.window.slide = parse_duration(flag_value());
+        } else if (arg == "--lateness") {
+            result.window.lateness = parse_duration(flag_value());
+        } else if (arg == "-i" || arg == "--input") {
+            result.input_path = flag_value();
+        } else if (arg == "-o" || arg == "--output" || arg == "--out") {
+            result.output_path = flag_value();
+        } else if (arg == "--auto") {
+            result.layout.auto_scale = true;
+        } else if (arg == "--repl") {
+            result.repl = true;
+        } else if (arg == "-a" || arg == "--all") {
+            result.all_units = true;
+        } else if (arg == "--range") {
+            result.range = flag_value();
+        } else if (arg == "--fixed") {
+            result.fixed_decimals = std::stoi(flag_value());
+            if (result.fixed_decimals < 0 || result.fixed_decimals > 9) {
+                throw std::invalid_argument(
+                    "'--fixed' takes 0 to 9 decimals.");
+            }
+        } else if (arg == "--listen-udp") {
+            result.udp_port = std::stoi(flag_value());
+            if (result.udp_port < 1 || result.udp_port > 65535) {
+                throw std::invalid_argument("UDP port must be 1-65535.");
+            }
+        } else if (arg == "--udp-sockets") {
+            int sockets = std::stoi(flag_value());
+            if (sockets < 1) {
+                throw std::invalid_argument(
+                    "Socket count must be at least 1.");
+            }
+            result.udp_sockets = static_cast<unsigned>(sockets);
+        } else if (arg == "--channel") {
+            result.channels.push_back(flag_value());
+        } else if (arg == "--forward") {
+            result.forward = flag_value();
+        } else if (arg == "-r" || arg == "--recursive") {
+            result.recursive_dir = flag_value();
+        } else if (arg == "--cache") {
+            result.cache_dir = flag_value();
+        } else if (arg == "--checkpoint") {
+            result.checkpoint = true;
+        } else if (arg == "--checkpoint-every") {
+            result.checkpoint = true;
+            result.checkpoint_interval = std::stod(flag_value());
+        } else if (arg == "--resume") {
+            result.checkpoint = true;
+            result.resume = true;
+        } else if (arg == "--shard") {
+            std::string spec = flag_value();
+            size_t slash = spec.find('/');
+            if (slash == std::string::npos) {
+                throw std::invalid_argument("'--shard' expects I/N.");
+            }
+            int index = std::stoi(spec.substr(0, slash));
+            int count = std::stoi(spec.substr(slash + 1));
+            if (count < 1 || index < 0 || index >= count) {
+                throw std::invalid_argument(
+                    "'--shard I/N' needs 0 <= I < N.");
+            }
+            result.shard.index = static_cast<size_t>(index);
+            result.shard.count = static_cast<size_t>(count);
+        } else if (arg == "--spool") {
+            result.spool_dir = flag_value();
+        } else if (arg == "--chunk-size") {
+            double mb = std::stod(flag_value());
+            if (mb <= 0.0) {
+                throw std::invalid_argument("Chunk size must be positive.");
+            }
+            result.chunk_size = static_cast<size_t>(mb * (1 << 20));
+        } else if (arg == "--lease") {
+            result.lease_seconds = std::stod(flag_value());
+            if (result.lease_seconds <= 0.0) {
+                throw std::invalid_argument("Lease time must be positive.");
+            }
+        } else if (arg == "--write-index") {
+            result.write_index = true;
+        } else if (arg == "--merge") {
+            result.merge_mode = flag_value();
+            if (result.merge_mode != "concat" &&
+                result.merge_mode != "groups" &&
+                result.merge_mode != "sketches" &&
+                result.merge_mode != "spool") {
+                throw std::invalid_argument("'--merge' mode must be concat, "
+                                            "groups, sketches or spool.");
+            }
+        } else if (arg == "--follow") {
+            result.follow_path = flag_value();
+        } else if (arg == "--state") {
+            result.state_path = flag_value();
+        } else if (arg == "--records") {
+            result.layout.records = true;
+            have_from = have_to = true;
+        } else if (arg == "-0" || arg == "--null") {
+            result.layout.separator = '\0';
+        } else if (arg == "--spill-groups") {
+            int groups = std::stoi(flag_value());
+            if (groups < 1) {
+                throw std::invalid_argument(
+                    "Spill threshold must be at least 1.");
+            }
+            result.spill_groups = static_cast<size_t>(groups);
+        } else if (arg == "-j" || arg == "--jobs") {
+            int jobs = std::stoi(flag_value());
+            if (jobs < 1) {
+                throw std::invalid_argument("Job count must be at least 1.");
+            }
+            result.jobs = static_cast<unsigned>(jobs);
+        } else if (arg == "--split") {
+            result.layout.split = flag_value();
+        } else if (arg == "--on-error") {
+            std::string mode = flag_value();
+            if (mode == "skip") {
+                result.layout.on_error = OnError::Skip;
+            } else if (mode == "nan") {
+                result.layout.on_error = OnError::Nan;
+            } else if (mode.rfind("reject:", 0) == 0 && mode.size() > 7) {
+                result.layout.on_error = OnError::Reject;
+                result.reject_path = mode.substr(7);
+            } else {
+                throw std::invalid_argument(
+                    "'--on-error' must be skip, nan or reject:FILE.");
+            }
+        } else if (arg == "--format") {
+            std::string name = flag_value();
+            const std::pair<const char *, OutputFormat> formats[] = {
+                {"text", OutputFormat::Text},   {"csv", OutputFormat::Csv},
+                {"tsv", OutputFormat::Tsv},     {"jsonl", OutputFormat::Jsonl},
+                {"fixed", OutputFormat::Fixed}, {"binary", OutputFormat::Binary},
+            };
+            auto it = std::find_if(
+                std::begin(formats), std::end(formats),
+                [&](const auto &format) { return name == format.first; });
+            if (it == std::end(formats)) {
+                throw std::invalid_argument(
+                    "Unknown format '" + name +
+                    "' (text, csv, tsv, jsonl, fixed, binary).");
+            }
+            result.layout.format = it->second;
+        } else if (arg == "--autotune") {
+            result.autotune = true;
+        } else if (arg == "--round-size") {
+            double mb = std::stod(flag_value());
+            if (mb <= 0.0) {
+                throw std::invalid_argument("Round size must be positive.");
+            }
+            result.batch_round = static_cast<size_t>(mb * (1 << 20));
+        } else if (arg == "--cpu") {
+            result.cpu = flag_value();
+        } else if (arg == "--memo") {
+            result.layout.memo = true;
+        } else if (arg == "--max-errors") {
+            long long limit = std::stoll(flag_value());
+            if (limit < 0) {
+                throw std::invalid_argument(
+                    "Error limit must not be negative.");
+            }
+            result.layout.max_errors = static_cast<uint64_t>(limit);
         } else {
-            try {
-                result.value = std::stod(arg);
-                have_value = true;
+            positional(arg);
+        }
+    }
 
-            } catch (const std::exception &) {
-                throw std::invalid_argument("Value must be a valid number.");
-            }
+    // Quantities name their own unit, so -f is only needed for bare
+    // numbers, and -t may come from an expression's `in UNIT` (main()
+    // checks). --split alone implies its largest unit as -t.
+    if (have_value && !have_number) {
+        have_from = true;
+        have_to = true;
+    }
+    // A template converts rows into its own `in UNIT`.
+    if (!result.layout.expression.empty()) {
+        have_from = true;
+        have_to = true;
+    }
+    if (!result.layout.split.empty() && !have_to) {
+        std::string first = result.layout.split.substr(
+            0, result.layout.split.find(','));
+        result.to_unit = normalize_unit(first);
+        result.to_units.push_back(result.to_unit);
+        have_to = true;
+    }
+
+    if (result.layout.format != OutputFormat::Text &&
+        (result.repl || result.all_units || !result.range.empty() ||
+         result.udp_port > 0 || result.stats || result.layout.group_col > 0 ||
+         result.window.size > 0.0)) {
+        throw std::runtime_error("'--format' only applies to values and "
+                                 "rows converted one by one.");
+    }
+
+    if (result.repl) {
+        // -f and -t are optional defaults for the session.
+        return result;
+    }
+
+    if (result.all_units) {
+        if (!have_from || !have_value) {
+            throw std::runtime_error("'--all' needs '-f' and a value.");
+        }
+        return result;
+    }
+
+    if (!result.range.empty()) {
+        if (!have_from || !have_to) {
+            throw std::runtime_error("'--range' needs '-f' and '-t'.");
+        }
+        return result;
+    }
+    if (result.to_units.size() > 1) {
+        // The last -t wins everywhere else, as it always has; only tables
+        // have a column for each.
+        result.to_units.erase(result.to_units.begin(),
+                              result.to_units.end() - 1);
+    }
+
+    if (result.udp_port > 0) {
+        if (result.channels.empty() && (!have_from || !have_to)) {
+            throw std::runtime_error(
+                "'--listen-udp' needs '--channel' or '-f' and '-t'.");
+        }
+        return result;
+    }
+
+    if (!result.merge_mode.empty() || result.write_index) {
+        if (result.write_index && result.input_path.empty()) {
+            throw std::runtime_error("'--write-index' needs '-i FILE'.");
+        }
+        return result;
+    }
+
+    if (result.window.size > 0.0) {
+        if (result.window.slide == 0.0) {
+            result.window.slide = result.window.size;
+        }
+        if (result.window.slide <= 0.0 ||
+            result.window.slide > result.window.size ||
+            result.window.lateness < 0.0) {
+            throw std::invalid_argument(
+                "Window slide must be in (0, window] and lateness >= 0.");
+        }
+        if (result.layout.time_col == 0) {
+            throw std::runtime_error("'--window' requires '--time-col'.");
         }
     }
 
-    if (!result.list_units && !result.show_help && !result.show_version) {
+    // Rows may name their own units ("5km"), so -f is optional for them.
+    if (result.layout.group_col > 0 || result.window.size > 0.0 ||
+        !result.follow_path.empty()) {
+        if (!have_to) {
+            throw std::runtime_error("Missing required arguments");
+        }
+    } else if (result.stats) {
+        // Saved sketches can be merged on their own, without reading input.
+        if (!have_to && result.sketch_in.empty()) {
+            throw std::runtime_error("Missing required arguments");
+        }
+    } else if (!result.list_units && !result.show_help &&
+               !result.show_version) {
+        // Without a value, rows come from -i, --recursive or a redirected
+        // stdin.
+        if (!have_value && have_to &&
+            (!result.input_path.empty() || !result.recursive_dir.empty() ||
+             !::isatty(STDIN_FILENO))) {
+            // Rows without -f must carry their units.
+            result.batch = true;
+            have_value = true;
+            have_from = true;
+        }
         if (!have_from || !have_to || !have_value) {
             throw std::runtime_error("Missing required arguments");
         }
     }
 
+    if (result.autotune &&
+        (!result.batch || !result.output_path.empty() ||
+         !result.cache_dir.empty() || result.checkpoint ||
+         !result.spool_dir.empty() || !result.recursive_dir.empty())) {
+        throw std::runtime_error("'--autotune' needs sample rows (-i FILE "
+                                 "or stdin) and the usual -f/-t, no -o.");
+    }
+    if (result.checkpoint &&
+        (result.stats || result.layout.group_col > 0 ||
+         result.window.size > 0.0 || !result.follow_path.empty() ||
+         !result.recursive_dir.empty())) {
+        throw std::runtime_error("'--checkpoint' and '--resume' only work "
+                                 "for plain batch conversion.");
+    }
+    if (result.checkpoint &&
+        (result.input_path.empty() || result.output_path.empty())) {
+        throw std::runtime_error(
+            "Checkpoints need both '-i' and '-o' files.");
+    }
+    if (!result.recursive_dir.empty() && result.output_path.empty()) {
+        throw std::runtime_error("'--recursive' needs an output directory "
+                                 "('-o' or '--out').");
+    }
+    if (!result.spool_dir.empty() && !result.batch) {
+        throw std::runtime_error("'--spool' needs '-f', '-t' and '-i FILE'.");
+    }
+    if (!result.spool_dir.empty() &&
+        (result.input_path.empty() || result.checkpoint ||
+         result.shard.count > 1 || !result.cache_dir.empty())) {
+        throw std::runtime_error("'--spool' needs '-i FILE' and replaces "
+                                 "'--shard', '--checkpoint' and '--cache'.");
+    }
+    if (result.layout.separator != '\n' &&
+        (!result.batch || result.checkpoint || result.shard.count > 1 ||
+         !result.cache_dir.empty() || !result.spool_dir.empty() ||
+         !result.recursive_dir.empty())) {
+        throw std::runtime_error(
+            "'--null' only works for plain batch conversion.");
+    }
+    if ((result.layout.auto_scale || !result.layout.split.empty()) &&
+        (result.layout.records || result.stats ||
+         result.layout.group_col > 0 || result.window.size > 0.0)) {
+        throw std::runtime_error(
+            "'--auto' and '--split' only apply to plain conversion.");
+    }
+    if (!result.layout.expression.empty() &&
+        ((!result.batch && result.follow_path.empty()) ||
+         result.layout.records ||
+         result.layout.unit_col > 0)) {
+        throw std::runtime_error("'$N' templates only apply to rows "
+                                 "converted in batch.");
+    }
+    if (result.layout.on_error != OnError::Skip &&
+        !result.batch && result.follow_path.empty()) {
+        throw std::runtime_error(
+            "'--on-error' only applies to rows converted in batch.");
+    }
+    if (result.layout.on_error == OnError::Reject &&
+        (!result.follow_path.empty() || result.checkpoint ||
+         !result.cache_dir.empty() || !result.spool_dir.empty())) {
+        throw std::runtime_error("'--on-error reject' only works for plain "
+                                 "and --recursive batch conversion.");
+    }
+    if (result.layout.format != OutputFormat::Text &&
+        (result.layout.auto_scale || !result.layout.split.empty())) {
+        throw std::runtime_error(
+            "'--auto' and '--split' only work with '--format text'.");
+    }
+    if (result.layout.memo &&
+        ((!result.batch && result.follow_path.empty()) ||
+         result.layout.records || !result.layout.expression.empty())) {
+        throw std::runtime_error(
+            "'--memo' only applies to plain rows converted in batch.");
+    }
+    if (result.layout.auto_scale && !result.layout.split.empty()) {
+        throw std::runtime_error(
+            "'--auto' and '--split' cannot be combined.");
+    }
+    if (result.layout.records &&
+        (result.stats || result.layout.group_col > 0 ||
+         result.window.size > 0.0)) {
+        throw std::runtime_error(
+            "'--records' cannot be combined with aggregation.");
+    }
+    if (result.checkpoint && result.shard.count > 1) {
+        throw std::runtime_error(
+            "'--checkpoint' and '--shard' cannot be combined.");
+    }
+    if (result.checkpoint && !result.cache_dir.empty()) {
+        throw std::runtime_error(
+            "'--checkpoint' and '--cache' cannot be combined.");
+    }
+
     return result;
 }
 
@@ -244,18 +1093,20 @@ convert_via_factors(const std::unordered_map<std::string, double> &factors,
     return value_in_base / to_factor;
 }
 
-double convert(const std::string &from_unit, const std::string &to_unit,
-               double value) {
+Expected<double> try_convert(const std::string &from_unit,
+                             const std::string &to_unit, double value) {
 
     UnitCategory cat_from = get_unit_category(from_unit);
     UnitCategory cat_to = get_unit_category(to_unit);
 
     if (cat_from == UnitCategory::Unknown || cat_to == UnitCategory::Unknown) {
-        throw std::runtime_error("Category unknown");
+        return ConvertFailure{ConvertError::UnknownUnit,
+                              cat_from == UnitCategory::Unknown ? from_unit
+                                                                : to_unit};
     }
 
     if (cat_from != cat_to) {
-        throw std::runtime_error("Incompatible categories");
+        return ConvertFailure{ConvertError::WrongKind, to_unit};
     }
 
     if (cat_from == UnitCategory::Length) {
@@ -270,76 +1121,5403 @@ double convert(const std::string &from_unit, const std::string &to_unit,
         return convert_via_factors(volume_factors, from_unit, to_unit, value);
     }
 
-    if (cat_from == UnitCategory::Tempurature) {
-        double in_c = temp_units.at(from_unit).to_celsius(value);
-        return temp_units.at(to_unit).from_celsius(in_c);
+    double in_c = temp_units.find(from_unit)->second.to_celsius(value);
+    return temp_units.find(to_unit)->second.from_celsius(in_c);
+}
+
+// The messages the command line has always printed.
+std::string failure_message(const ConvertFailure &failure) {
+    return failure.code == ConvertError::UnknownUnit
+               ? "Category unknown"
+               : "Incompatible categories";
+}
+
+double convert(const std::string &from_unit, const std::string &to_unit,
+               double value) {
+    Expected<double> result = try_convert(from_unit, to_unit, value);
+    if (!result) {
+        throw std::runtime_error(failure_message(result.error()));
+    }
+    return *result;
+}
+
+// Every supported category is affine (temperature only adds an offset), so
+// a from/to pair can be resolved once into `value * scale + offset` and
+// applied to a whole stream without touching the unit maps again.
+struct ConversionPlan {
+    std::string from_unit;
+    std::string to_unit;
+    double scale{1.0};
+    double offset{0.0};
+
+    double apply(double value) const { return value * scale + offset; }
+};
+
+Expected<ConversionPlan> try_make_plan(const std::string &from_unit,
+                                       const std::string &to_unit) {
+    ConversionPlan plan;
+    plan.from_unit = from_unit;
+    plan.to_unit = to_unit;
+
+    Expected<double> unit = try_convert(from_unit, to_unit, 1.0);
+    if (!unit) {
+        return unit.error();
+    }
+
+    if (get_unit_category(from_unit) == UnitCategory::Tempurature) {
+        // Anchor the line at 0 C, so readings at the freezing point (32 F,
+        // 273.15 K) come out exact. Temperature slopes are ratios of small
+        // integers (1, 9/5, 5/9); snapping the measured slope to that ratio
+        // keeps rounding in the unit functions out of every result.
+        constexpr double kStep = 1 << 20;
+        double x0 = temp_units.find(from_unit)->second.from_celsius(0.0);
+        double y0 = temp_units.find(to_unit)->second.from_celsius(0.0);
+        double slope = (*try_convert(from_unit, to_unit, x0 + kStep) - y0) /
+                       kStep;
+        plan.scale = slope;
+        for (int q = 1; q <= 9; ++q) {
+            double r = std::round(slope * q);
+            if (std::fabs(slope * q - r) < 1e-9) {
+                plan.scale = r / q;
+                break;
+            }
+        }
+        plan.offset = y0 - x0 * plan.scale;
+    } else {
+        plan.scale = *unit;
     }
 
-    // Should never get here, but just in case:
-    throw std::runtime_error("Unhandled category");
+    return plan;
 }
 
-void print_units() {
-    std::cout << "Supported units:\n\n";
+ConversionPlan make_plan(const std::string &from_unit,
+                         const std::string &to_unit) {
+    Expected<ConversionPlan> plan = try_make_plan(from_unit, to_unit);
+    if (!plan) {
+        throw std::runtime_error(failure_message(plan.error()));
+    }
+    return *plan;
+}
+
+// Memo of resolved plans by (from, to) for long-lived sessions that keep
+// asking about the same handful of units.
+class PlanRegistry {
+  public:
+    const ConversionPlan &get(const std::string &from_unit,
+                              const std::string &to_unit) {
+        key_.assign(from_unit);
+        key_ += '\0';
+        key_ += to_unit;
+        auto it = plans_.find(key_);
+        if (it == plans_.end()) {
+            it = plans_.emplace(key_, make_plan(from_unit, to_unit)).first;
+        }
+        return it->second;
+    }
+
+  private:
+    std::string key_;
+    std::unordered_map<std::string, ConversionPlan> plans_;
+};
+
+// Every unit key of `category`, smallest unit first (ties by name), so
+// listings no longer follow unordered_map iteration order.
+std::vector<std::string> units_by_size(UnitCategory category) {
+    std::vector<std::pair<std::pair<double, double>, std::string>> sized;
+    auto add_factors = [&](const std::unordered_map<std::string, double> &m) {
+        for (const auto &[unit, factor] : m) {
+            sized.push_back({{factor, 0.0}, unit});
+        }
+    };
 
-    std::cout << "Length:\n  ";
-    for (const auto &[unit, factor] : length_factors) {
-        std::cout << unit << "  ";
+    switch (category) {
+    case UnitCategory::Length:
+        add_factors(length_factors);
+        break;
+    case UnitCategory::Mass:
+        add_factors(mass_factors);
+        break;
+    case UnitCategory::Volume:
+        add_factors(volume_factors);
+        break;
+    case UnitCategory::Tempurature:
+        // Size of one degree, then where the scale starts.
+        for (const auto &[unit, funcs] : temp_units) {
+            ConversionPlan plan = make_plan(unit, "C");
+            sized.push_back({{plan.scale, plan.offset}, unit});
+        }
+        break;
+    case UnitCategory::Unknown:
+        break;
     }
-    std::cout << "\n\n";
 
-    std::cout << "Mass:\n  ";
-    for (const auto &[unit, factor] : mass_factors) {
-        std::cout << unit << "  ";
+    std::sort(sized.begin(), sized.end());
+    std::vector<std::string> units;
+    for (auto &entry : sized) {
+        units.push_back(std::move(entry.second));
     }
-    std::cout << "\n\n";
+    return units;
+}
 
-    std::cout << "Volume:\n  ";
-    for (const auto &[unit, factor] : volume_factors) {
-        std::cout << unit << "  ";
+// Parses a single number out of [begin, end), ignoring surrounding blanks.
+bool parse_number(const char *begin, const char *end, double &out) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) {
+        ++begin;
+    }
+    while (end > begin &&
+           (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        --end;
+    }
+    if (begin < end && *begin == '+') {
+        ++begin;
     }
-    std::cout << "\n\n";
 
-    std::cout << "Temperature:\n  ";
-    for (const auto &[unit, funcs] : temp_units) {
-        std::cout << unit << "  ";
+    auto [ptr, ec] = std::from_chars(begin, end, out);
+    return ec == std::errc() && ptr == end && begin != end;
+}
+
+std::string read_all(std::FILE *in) {
+    std::string data;
+    char block[1 << 16];
+    size_t got;
+    while ((got = std::fread(block, 1, sizeof(block), in)) > 0) {
+        data.append(block, got);
     }
-    std::cout << "\n";
+    return data;
 }
 
-int main(int argc, char *argv[]) {
-    try {
-        Args args = parse_args(argc, argv);
+// Splits `data` into at most `parts` ranges that each end on a line
+// boundary, so workers never see half a line.
+std::vector<std::pair<size_t, size_t>>
+split_lines(std::string_view data, size_t parts, char separator = '\n') {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t begin = 0;
 
-        if (args.show_help) {
-            print_usage();
-            std::cout << "For a list of units, use the -l or --list flag.\n";
-            return 0;
+    for (size_t part = 1; part <= parts && begin < data.size(); ++part) {
+        size_t end = data.size();
+        if (part < parts) {
+            end = std::max(begin, data.size() * part / parts);
+            size_t newline = data.find(separator, end);
+            end = newline == std::string_view::npos ? data.size()
+                                                    : newline + 1;
         }
+        ranges.emplace_back(begin, end);
+        begin = end;
+    }
 
-        if (args.list_units) {
-            print_units();
-            return 0;
+    return ranges;
+}
+
+// Calls `fn(line)` for every line in `data`, without the trailing newline.
+template <typename Fn>
+void for_each_line(std::string_view data, Fn fn, char separator = '\n') {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t newline = data.find(separator, pos);
+        if (newline == std::string_view::npos) {
+            newline = data.size();
         }
+        fn(data.substr(pos, newline - pos));
+        pos = newline + 1;
+    }
+}
 
-        if (args.show_version) {
-            std::cout << "Current Version:\t\033[1;32m" << PROGRAM_VERSION
-                      << "\033[0m\n";
-            return 0;
+// What this process may use, as opposed to what the machine has: the CPUs
+// in its affinity mask, capped by a cgroup CPU quota, and its cgroup
+// memory limit (0 when there is none). cgroup v2 is tried before v1.
+struct MachineBudget {
+    unsigned cpus{1};
+    uint64_t memory{0};
+};
+
+// First line of a small file, or "" when it cannot be read.
+std::string read_first_line(const std::string &path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+MachineBudget detect_budget() {
+    MachineBudget budget;
+    cpu_set_t set;
+    budget.cpus = ::sched_getaffinity(0, sizeof(set), &set) == 0
+                      ? static_cast<unsigned>(CPU_COUNT(&set))
+                      : std::thread::hardware_concurrency();
+    budget.cpus = std::max(1u, budget.cpus);
+
+    // Lines of /proc/self/cgroup are "ID:CONTROLLERS:/path"; the v2 line
+    // has no controllers and is filed under "".
+    std::map<std::string, std::string> groups;
+    std::ifstream self("/proc/self/cgroup");
+    for (std::string line; std::getline(self, line);) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) {
+            continue;
+        }
+        std::stringstream controllers(
+            line.substr(first + 1, second - first - 1));
+        std::string name;
+        if (first + 1 == second) {
+            groups[""] = line.substr(second + 1);
+        }
+        while (std::getline(controllers, name, ',')) {
+            groups[name] = line.substr(second + 1);
         }
+    }
+    // The process's own group when the whole hierarchy is mounted, else
+    // the mount root (inside a container, the mount is the group).
+    auto control = [&](const std::string &controller,
+                       const std::string &file) {
+        std::string root =
+            "/sys/fs/cgroup" + (controller.empty() ? "" : "/" + controller);
+        auto it = groups.find(controller);
+        if (it != groups.end()) {
+            std::string value = read_first_line(root + it->second + "/" + file);
+            if (!value.empty()) {
+                return value;
+            }
+        }
+        return read_first_line(root + "/" + file);
+    };
 
-        if (args.from_unit == "" || args.to_unit == "") {
-            print_usage();
-            return 1;
+    // "QUOTA PERIOD" or "max PERIOD"; v1 keeps them apart, -1 for none.
+    double quota = 0.0, period = 0.0;
+    std::istringstream cpu_max(control("", "cpu.max"));
+    std::string text;
+    if (cpu_max >> text >> period) {
+        quota = text == "max" ? 0.0 : std::strtod(text.c_str(), nullptr);
+    } else {
+        quota = std::strtod(control("cpu", "cpu.cfs_quota_us").c_str(),
+                            nullptr);
+        period = std::strtod(control("cpu", "cpu.cfs_period_us").c_str(),
+                             nullptr);
+    }
+    if (quota > 0.0 && period > 0.0) {
+        budget.cpus = std::min(
+            budget.cpus,
+            std::max(1u, static_cast<unsigned>(std::ceil(quota / period))));
+    }
+
+    // "max" in v2; v1 reports no limit as a number near 2^63.
+    text = control("", "memory.max");
+    if (text.empty()) {
+        text = control("memory", "memory.limit_in_bytes");
+    }
+    uint64_t memory = std::strtoull(text.c_str(), nullptr, 10);
+    if (memory > 0 && memory < (uint64_t{1} << 60)) {
+        budget.memory = memory;
+    }
+    return budget;
+}
+
+const MachineBudget &machine_budget() {
+    static const MachineBudget budget = detect_budget();
+    return budget;
+}
+
+unsigned worker_count(unsigned requested) {
+    if (requested > 0) {
+        return requested;
+    }
+    return machine_budget().cpus;
+}
+
+// "0-3,8-11" (the sysfs list format) -> 0 1 2 3 8 9 10 11.
+std::vector<int> parse_cpu_list(const std::string &text) {
+    std::vector<int> ids;
+    std::stringstream in(text);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        char *end = nullptr;
+        long first = std::strtol(range.c_str(), &end, 10);
+        if (end == range.c_str()) {
+            continue;
+        }
+        long last = *end == '-' ? std::strtol(end + 1, nullptr, 10) : first;
+        for (long id = first; id <= last; ++id) {
+            ids.push_back(static_cast<int>(id));
+        }
+    }
+    return ids;
+}
+
+// NUMA nodes from sysfs, each with the CPUs this process may run on; nodes
+// left with none are dropped. Without a node directory (or on a kernel
+// without NUMA) the list is empty, which reads as a single node.
+std::vector<std::vector<int>> detect_numa_nodes() {
+    cpu_set_t allowed;
+    if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+    const std::string root = "/sys/devices/system/node/";
+    std::vector<std::vector<int>> nodes;
+    for (int node : parse_cpu_list(read_first_line(root + "online"))) {
+        std::vector<int> cpus;
+        for (int cpu : parse_cpu_list(read_first_line(
+                 root + "node" + std::to_string(node) + "/cpulist"))) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(std::move(cpus));
+        }
+    }
+    return nodes;
+}
+
+const std::vector<std::vector<int>> &numa_nodes() {
+    static const std::vector<std::vector<int>> nodes = detect_numa_nodes();
+    return nodes;
+}
+
+// Binds worker `index` of `count` to the CPUs of one node, leaving the
+// scheduler to spread the node's workers over them (a fixed core would
+// collide with other jobs and whatever else the machine runs). Nodes take
+// contiguous blocks of workers in proportion to their CPUs, and workers get
+// contiguous slices of the input in index order, so each node works through
+// one region of a mapped file and its page-cache pages are faulted in (and
+// kept) locally. Does nothing on single-node machines.
+void place_worker(size_t index, size_t count) {
+    const auto &nodes = numa_nodes();
+    if (nodes.size() < 2) {
+        return;
+    }
+    size_t total = 0;
+    for (const auto &cpus : nodes) {
+        total += cpus.size();
+    }
+    size_t seen = 0;
+    for (const auto &cpus : nodes) {
+        seen += cpus.size();
+        if (index < count * seen / total) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus) {
+                CPU_SET(cpu, &set);
+            }
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+            return;
         }
+    }
+}
+
+// Runs `work(index)` on `count` threads and waits for all of them. On NUMA
+// machines each thread is placed first (see place_worker), so whatever
+// `work` allocates and fills is first touched on, and kept by, its node.
+// An exception from any worker is rethrown here once all have finished,
+// as it would be with a single worker.
+template <typename Work> void run_workers(size_t count, Work work) {
+    if (count == 1) {
+        work(0);
+        return;
+    }
 
-        double result = convert(args.from_unit, args.to_unit, args.value);
+    std::vector<std::exception_ptr> failures(count);
+    std::vector<std::thread> threads;
+    threads.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        threads.emplace_back([&work, &failures, i, count] {
+            try {
+                place_worker(i, count);
+                work(i);
+            } catch (...) {
+                failures[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (const auto &failure : failures) {
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+    }
+}
 
-        // Print out values.
-        std::cout << "From: " << args.from_unit << "\n"
+// KLL quantile sketch (Karnin, Lang, Liberty). Level h holds items of
+// weight 2^h; when the sketch grows past its capacity the lowest full level
+// is sorted and every other item is promoted. Two sketches merge by
+// concatenating their levels and compacting again.
+class KllSketch {
+  public:
+    explicit KllSketch(uint32_t k = 200) : k_(k), levels_(1) {
+        update_capacity();
+    }
+
+    void add(double value) {
+        levels_[0].push_back(value);
+        if (++size_ > capacity_) {
+            compress();
+        }
+    }
+
+    void merge(const KllSketch &other) {
+        if (other.levels_.size() > levels_.size()) {
+            levels_.resize(other.levels_.size());
+            update_capacity();
+        }
+        for (size_t h = 0; h < other.levels_.size(); ++h) {
+            levels_[h].insert(levels_[h].end(), other.levels_[h].begin(),
+                              other.levels_[h].end());
+        }
+        size_ += other.size_;
+        compress();
+    }
+
+    // Returns the value at rank q * total weight, or NaN when empty.
+    double quantile(double q) const {
+        std::vector<std::pair<double, uint64_t>> items;
+        items.reserve(size_);
+        uint64_t total = 0;
+        for (size_t h = 0; h < levels_.size(); ++h) {
+            for (double v : levels_[h]) {
+                items.emplace_back(v, uint64_t{1} << h);
+                total += uint64_t{1} << h;
+            }
+        }
+        if (items.empty()) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        std::sort(items.begin(), items.end());
+        double target = q * static_cast<double>(total);
+        uint64_t seen = 0;
+        for (const auto &[value, weight] : items) {
+            seen += weight;
+            if (static_cast<double>(seen) >= target) {
+                return value;
+            }
+        }
+        return items.back().first;
+    }
+
+    void serialize(std::ostream &out) const {
+        out << "kll " << k_ << ' ' << levels_.size() << '\n';
+        for (const auto &level : levels_) {
+            out << level.size();
+            for (double v : level) {
+                out << ' ' << v;
+            }
+            out << '\n';
+        }
+    }
+
+    // A saved sketch was compressed when written, so it holds no more
+    // items than its levels can for its k; anything else (including no
+    // levels, or more than item weights can count) is refused before
+    // allocating for it.
+    static KllSketch deserialize(std::istream &in) {
+        std::string tag;
+        uint32_t k = 0;
+        size_t level_count = 0;
+        if (!(in >> tag >> k >> level_count) || tag != "kll" || k < 8 ||
+            k > kMaxK || level_count == 0 || level_count > 64) {
+            throw std::runtime_error("Malformed quantile sketch");
+        }
+
+        KllSketch sketch(k);
+        sketch.levels_.resize(level_count);
+        sketch.update_capacity();
+        for (auto &level : sketch.levels_) {
+            size_t count = 0;
+            if (!(in >> count) || count > sketch.capacity_ - sketch.size_) {
+                throw std::runtime_error("Malformed quantile sketch");
+            }
+            level.resize(count);
+            for (double &v : level) {
+                in >> v;
+            }
+            sketch.size_ += count;
+        }
+        if (!in) {
+            throw std::runtime_error("Malformed quantile sketch");
+        }
+        return sketch;
+    }
+
+  private:
+    static constexpr uint32_t kMaxK = 1 << 16;
+
+    size_t level_capacity(size_t h) const {
+        size_t depth = levels_.size() - 1 - h;
+        double cap = std::ceil(k_ * std::pow(2.0 / 3.0, depth));
+        return std::max<size_t>(2, static_cast<size_t>(cap));
+    }
+
+    void update_capacity() {
+        capacity_ = 0;
+        for (size_t h = 0; h < levels_.size(); ++h) {
+            capacity_ += level_capacity(h);
+        }
+    }
+
+    void compress() {
+        while (size_ > capacity_) {
+            size_t h = 0;
+            while (levels_[h].size() < level_capacity(h)) {
+                ++h;
+            }
+            if (h + 1 == levels_.size()) {
+                levels_.emplace_back();
+                update_capacity();
+            }
+
+            auto &level = levels_[h];
+            std::sort(level.begin(), level.end());
+
+            // An odd item stays behind so the total weight is preserved.
+            size_t keep = level.size() & 1;
+            rng_ ^= rng_ << 13;
+            rng_ ^= rng_ >> 7;
+            rng_ ^= rng_ << 17;
+            for (size_t i = keep + (rng_ & 1); i < level.size(); i += 2) {
+                levels_[h + 1].push_back(level[i]);
+            }
+
+            size_ -= (level.size() - keep) / 2;
+            level.resize(keep);
+        }
+    }
+
+    uint32_t k_;
+    std::vector<std::vector<double>> levels_;
+    size_t size_{0};
+    size_t capacity_{0};
+    uint64_t rng_{0x9E3779B97F4A7C15ull};
+};
+
+// Log-linear histogram: each power of two is cut into kSubBuckets equal
+// slices, so bucket width stays within ~3% of the values it holds at any
+// magnitude. Counts are exact and merge by addition.
+class LogLinearHistogram {
+  public:
+    static constexpr int kSubBuckets = 16;
+
+    void add(double value) {
+        if (value == 0.0) {
+            ++zeros_;
+        } else if (value > 0.0) {
+            ++positive_[bucket_of(value)];
+        } else {
+            ++negative_[bucket_of(-value)];
+        }
+    }
+
+    void merge(const LogLinearHistogram &other) {
+        zeros_ += other.zeros_;
+        for (const auto &[key, count] : other.positive_) {
+            positive_[key] += count;
+        }
+        for (const auto &[key, count] : other.negative_) {
+            negative_[key] += count;
+        }
+    }
+
+    void print(std::ostream &out) const {
+        for (auto it = negative_.rbegin(); it != negative_.rend(); ++it) {
+            auto [lo, hi] = bounds_of(it->first);
+            out << "  [" << -hi << ", " << -lo << ")\t" << it->second
+                << '\n';
+        }
+        if (zeros_ > 0) {
+            out << "  0\t" << zeros_ << '\n';
+        }
+        for (const auto &[key, count] : positive_) {
+            auto [lo, hi] = bounds_of(key);
+            out << "  [" << lo << ", " << hi << ")\t" << count << '\n';
+        }
+    }
+
+    void serialize(std::ostream &out) const {
+        out << "hist " << zeros_ << ' ' << positive_.size() << ' '
+            << negative_.size() << '\n';
+        for (const auto &[key, count] : positive_) {
+            out << key << ' ' << count << '\n';
+        }
+        for (const auto &[key, count] : negative_) {
+            out << key << ' ' << count << '\n';
+        }
+    }
+
+    static LogLinearHistogram deserialize(std::istream &in) {
+        LogLinearHistogram hist;
+        std::string tag;
+        size_t positive = 0;
+        size_t negative = 0;
+        if (!(in >> tag >> hist.zeros_ >> positive >> negative) ||
+            tag != "hist") {
+            throw std::runtime_error("Malformed histogram");
+        }
+
+        int32_t key;
+        uint64_t count;
+        for (size_t i = 0; i < positive && in >> key >> count; ++i) {
+            hist.positive_[key] += count;
+        }
+        for (size_t i = 0; i < negative && in >> key >> count; ++i) {
+            hist.negative_[key] += count;
+        }
+        if (!in) {
+            throw std::runtime_error("Malformed histogram");
+        }
+        return hist;
+    }
+
+  private:
+    // Offsets the binary exponent so keys stay positive for subnormals.
+    static constexpr int kExponentBias = 1100;
+
+    static int32_t bucket_of(double magnitude) {
+        int exponent;
+        double mantissa = std::frexp(magnitude, &exponent); // [0.5, 1)
+        int sub = static_cast<int>((mantissa - 0.5) * 2 * kSubBuckets);
+        return (exponent + kExponentBias) * kSubBuckets + sub;
+    }
+
+    static std::pair<double, double> bounds_of(int32_t key) {
+        int exponent = key / kSubBuckets - kExponentBias;
+        int sub = key % kSubBuckets;
+        double lo = std::ldexp(0.5 + sub / (2.0 * kSubBuckets), exponent);
+        double hi =
+            std::ldexp(0.5 + (sub + 1) / (2.0 * kSubBuckets), exponent);
+        return {lo, hi};
+    }
+
+    uint64_t zeros_{0};
+    std::map<int32_t, uint64_t> positive_;
+    std::map<int32_t, uint64_t> negative_;
+};
+
+// Mergeable summary of one converted stream. Each worker fills its own and
+// the results are folded together at the end; the same merge combines
+// sketches saved by earlier runs or other machines.
+struct StreamSketch {
+    std::string unit;
+    uint64_t count{0};
+    uint64_t rejected{0};
+    double sum{0.0};
+    double min{std::numeric_limits<double>::infinity()};
+    double max{-std::numeric_limits<double>::infinity()};
+    KllSketch quantiles;
+    LogLinearHistogram histogram;
+
+    void add(double value) {
+        if (!std::isfinite(value)) {
+            ++rejected;
+            return;
+        }
+        ++count;
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+        quantiles.add(value);
+        histogram.add(value);
+    }
+
+    void merge(const StreamSketch &other) {
+        if (unit.empty()) {
+            unit = other.unit;
+        } else if (!other.unit.empty() && other.unit != unit) {
+            throw std::runtime_error("Cannot merge sketches in '" + unit +
+                                     "' and '" + other.unit + "'");
+        }
+        count += other.count;
+        rejected += other.rejected;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        quantiles.merge(other.quantiles);
+        histogram.merge(other.histogram);
+    }
+
+    double quantile(double q) const {
+        if (count == 0) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        if (q <= 0.0) {
+            return min;
+        }
+        if (q >= 1.0) {
+            return max;
+        }
+        return std::clamp(quantiles.quantile(q), min, max);
+    }
+
+    void save(const std::string &path) const {
+        std::ofstream out(path);
+        if (!out) {
+            throw std::runtime_error("Cannot write sketch to " + path);
+        }
+        out.precision(17);
+        out << "xcvt-sketch 1\n"
+            << "unit " << unit << '\n'
+            << "summary " << count << ' ' << rejected << ' ' << sum << ' '
+            << min << ' ' << max << '\n';
+        quantiles.serialize(out);
+        histogram.serialize(out);
+    }
+
+    static StreamSketch load(const std::string &path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Cannot read sketch from " + path);
+        }
+
+        StreamSketch sketch;
+        std::string magic, version, tag;
+        in >> magic >> version;
+        if (magic != "xcvt-sketch" || version != "1") {
+            throw std::runtime_error(path + " is not an xcvt sketch");
+        }
+        in >> tag >> sketch.unit;
+        in >> tag >> sketch.count >> sketch.rejected >> sketch.sum;
+        // Empty sketches store +/-inf, which operator>> will not read back.
+        std::string lo, hi;
+        in >> lo >> hi;
+        if (sketch.count > 0) {
+            sketch.min = std::stod(lo);
+            sketch.max = std::stod(hi);
+        }
+        sketch.quantiles = KllSketch::deserialize(in);
+        sketch.histogram = LogLinearHistogram::deserialize(in);
+        return sketch;
+    }
+};
+
+// Running count/sum/min/max for one group-by key.
+struct GroupAggregate {
+    uint64_t count{0};
+    double sum{0.0};
+    double min{std::numeric_limits<double>::infinity()};
+    double max{-std::numeric_limits<double>::infinity()};
+
+    void add(double value) {
+        ++count;
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void merge(const GroupAggregate &other) {
+        count += other.count;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+};
+
+// FNV-1a, with the low bit forced on so 0 can mark an empty slot.
+uint64_t hash_key(std::string_view key) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char ch : key) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 0x100000001b3ull;
+    }
+    return hash | 1;
+}
+
+// Open-addressing (linear probing) table of group aggregates. Keys live in
+// one arena string so a slot is a fixed 56 bytes and probing stays inside a
+// couple of cache lines.
+class GroupTable {
+  public:
+    explicit GroupTable(size_t capacity = 1024) : slots_(capacity) {}
+
+    GroupAggregate &find_or_insert(std::string_view key, uint64_t hash) {
+        if ((size_ + 1) * 2 > slots_.size()) {
+            grow();
+        }
+
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot &slot = slots_[i];
+            if (slot.hash == 0) {
+                slot.hash = hash;
+                slot.key_offset = keys_.size();
+                slot.key_length = key.size();
+                keys_.append(key);
+                ++size_;
+                return slot.aggregate;
+            }
+            if (slot.hash == hash && key_of(slot) == key) {
+                return slot.aggregate;
+            }
+        }
+    }
+
+    size_t size() const { return size_; }
+
+    void clear() {
+        std::fill(slots_.begin(), slots_.end(), Slot{});
+        keys_.clear();
+        size_ = 0;
+    }
+
+    // Calls fn(key, hash, aggregate) for every group, in slot order.
+    template <typename Fn> void for_each(Fn fn) const {
+        for (const Slot &slot : slots_) {
+            if (slot.hash != 0) {
+                fn(key_of(slot), slot.hash, slot.aggregate);
+            }
+        }
+    }
+
+  private:
+    struct Slot {
+        uint64_t hash{0};
+        size_t key_offset{0};
+        size_t key_length{0};
+        GroupAggregate aggregate;
+    };
+
+    std::string_view key_of(const Slot &slot) const {
+        return std::string_view(keys_).substr(slot.key_offset,
+                                              slot.key_length);
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        size_t mask = slots_.size() - 1;
+        for (const Slot &slot : old) {
+            if (slot.hash == 0) {
+                continue;
+            }
+            size_t i = slot.hash & mask;
+            while (slots_[i].hash != 0) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = slot;
+        }
+    }
+
+    std::vector<Slot> slots_;
+    std::string keys_;
+    size_t size_{0};
+};
+
+struct FileCloser {
+    void operator()(std::FILE *file) const { std::fclose(file); }
+};
+
+using FileHandle = std::unique_ptr<std::FILE, FileCloser>;
+
+// When a worker's table passes its group limit it is flushed to temporary
+// files partitioned by the top bits of the key hash. Every partition then
+// holds a disjoint set of keys and can be aggregated on its own, so the
+// final merge never needs more than one partition in memory.
+class GroupSpill {
+  public:
+    static constexpr int kPartitionBits = 6;
+    static constexpr size_t kPartitions = size_t{1} << kPartitionBits;
+
+    static size_t partition_of(uint64_t hash) {
+        return hash >> (64 - kPartitionBits);
+    }
+
+    void write(const GroupTable &table) {
+        if (files_.empty()) {
+            files_.resize(kPartitions);
+        }
+        table.for_each([&](std::string_view key, uint64_t hash,
+                           const GroupAggregate &aggregate) {
+            FileHandle &file = files_[partition_of(hash)];
+            if (!file) {
+                file.reset(std::tmpfile());
+                if (!file) {
+                    throw std::runtime_error("Cannot create spill file");
+                }
+            }
+            uint64_t length = key.size();
+            std::fwrite(&hash, sizeof(hash), 1, file.get());
+            std::fwrite(&length, sizeof(length), 1, file.get());
+            std::fwrite(key.data(), 1, key.size(), file.get());
+            std::fwrite(&aggregate, sizeof(aggregate), 1, file.get());
+        });
+    }
+
+    bool empty() const { return files_.empty(); }
+
+    // Folds every record spilled to `partition` into `table`.
+    void read(size_t partition, GroupTable &table) const {
+        if (files_.empty() || !files_[partition]) {
+            return;
+        }
+
+        std::FILE *file = files_[partition].get();
+        std::rewind(file);
+        uint64_t hash, length;
+        std::string key;
+        GroupAggregate aggregate;
+        while (std::fread(&hash, sizeof(hash), 1, file) == 1 &&
+               std::fread(&length, sizeof(length), 1, file) == 1) {
+            key.resize(length);
+            if (std::fread(key.data(), 1, length, file) != length ||
+                std::fread(&aggregate, sizeof(aggregate), 1, file) != 1) {
+                throw std::runtime_error("Truncated spill file");
+            }
+            table.find_or_insert(key, hash).merge(aggregate);
+        }
+    }
+
+  private:
+    std::vector<FileHandle> files_;
+};
+
+// Writes the shortest text that reads back as exactly `value`, so printed
+// aggregates can be merged again without losing precision. The appending
+// form is for row writers, which must not allocate per row.
+void append_exact(std::string &out, double value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+std::string exact_number(double value) {
+    std::string text;
+    append_exact(text, value);
+    return text;
+}
+
+void print_groups(const GroupTable &table, std::ostream &out) {
+    std::vector<std::pair<std::string_view, const GroupAggregate *>> rows;
+    rows.reserve(table.size());
+    table.for_each([&](std::string_view key, uint64_t,
+                       const GroupAggregate &aggregate) {
+        rows.emplace_back(key, &aggregate);
+    });
+    std::sort(rows.begin(), rows.end());
+
+    for (const auto &[key, aggregate] : rows) {
+        out << key << '\t' << aggregate->count << '\t'
+            << exact_number(aggregate->sum) << '\t'
+            << aggregate->sum / static_cast<double>(aggregate->count) << '\t'
+            << exact_number(aggregate->min) << '\t'
+            << exact_number(aggregate->max) << '\n';
+    }
+}
+
+// The fields of one row that the layout asks for; absent columns are empty.
+struct RowFields {
+    std::string_view value;
+    std::string_view unit;
+    std::string_view key;
+    std::string_view time;
+};
+
+// Splits `line` on the layout's delimiter, stopping after the last column
+// it needs. Returns false when the row is too short.
+bool split_row(std::string_view line, const RowLayout &layout,
+               RowFields &fields) {
+    size_t last_col = std::max({layout.value_col, layout.unit_col,
+                                layout.group_col, layout.time_col});
+    size_t col = 1, pos = 0;
+    while (col <= last_col && pos <= line.size()) {
+        size_t next = line.find(layout.delimiter, pos);
+        if (next == std::string_view::npos) {
+            next = line.size();
+        }
+        std::string_view field = line.substr(pos, next - pos);
+        if (col == layout.value_col) {
+            fields.value = field;
+        }
+        if (col == layout.unit_col) {
+            fields.unit = field;
+        }
+        if (col == layout.group_col) {
+            fields.key = field;
+        }
+        if (col == layout.time_col) {
+            fields.time = field;
+        }
+        pos = next + 1;
+        ++col;
+    }
+    return col > last_col;
+}
+
+// Per-thread memo from a row's unit text to its plan. Inputs rarely mix
+// more than a handful of units, so a linear scan beats hashing here.
+class PlanCache {
+  public:
+    explicit PlanCache(std::string to_unit) : to_unit_(std::move(to_unit)) {}
+
+    // Failures are remembered too; their context is `unit` itself.
+    Expected<const ConversionPlan *> find(std::string_view unit) {
+        for (const auto &[text, plan] : entries_) {
+            if (text == unit) {
+                return result(plan, unit);
+            }
+        }
+
+        entries_.emplace_back(
+            std::string(unit),
+            try_make_plan(normalize_unit(std::string(unit)), to_unit_));
+        return result(entries_.back().second, unit);
+    }
+
+  private:
+    static Expected<const ConversionPlan *>
+    result(const Expected<ConversionPlan> &plan, std::string_view unit) {
+        if (!plan) {
+            return ConvertFailure{plan.error().code, unit};
+        }
+        return &*plan;
+    }
+
+    std::string to_unit_;
+    std::vector<std::pair<std::string, Expected<ConversionPlan>>> entries_;
+};
+
+// Scans one number starting at `p`, the way people write them: an optional
+// sign, digits with optional thousands separators ("1,234,567.5"), a
+// fraction or exponent, and fractional forms "3/8" and "5 3/8". Commas only
+// count as separators before groups of exactly three digits, so "1,5" stops
+// at the comma. Advances `p` past the number; no allocation.
+bool scan_number(const char *&p, const char *end, double &out) {
+    auto is_digit = [&](const char *q) {
+        return q < end && *q >= '0' && *q <= '9';
+    };
+    auto digits = [&](const char *q) {
+        while (is_digit(q)) {
+            ++q;
+        }
+        return q;
+    };
+
+    const char *begin = p;
+    const char *q = p;
+    bool negative = q < end && (*q == '-' || *q == '+');
+    if (negative) {
+        negative = *q == '-';
+        ++q;
+    }
+    const char *int_begin = q;
+    q = digits(q);
+    bool grouped = false;
+    while (q > int_begin && q + 3 < end + 1 && *q == ',' &&
+           digits(q + 1) == q + 4) {
+        grouped = true;
+        q += 4;
+    }
+    bool integer = q > int_begin;
+    if (q < end && *q == '.' && (is_digit(q + 1) || integer)) {
+        q = digits(q + 1);
+        integer = false;
+    }
+    if (q == int_begin) {
+        return false;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char *exp = q + 1;
+        if (exp < end && (*exp == '-' || *exp == '+')) {
+            ++exp;
+        }
+        if (is_digit(exp)) {
+            q = digits(exp);
+            integer = false;
+        }
+    }
+
+    // Copy out the digits only when separators have to go.
+    char buffer[64];
+    const char *number = int_begin;
+    const char *number_end = q;
+    if (grouped) {
+        if (q - int_begin > static_cast<ptrdiff_t>(sizeof(buffer))) {
+            return false;
+        }
+        char *w = buffer;
+        for (const char *r = int_begin; r < q; ++r) {
+            if (*r != ',') {
+                *w++ = *r;
+            }
+        }
+        number = buffer;
+        number_end = w;
+    }
+    double value;
+    auto [ptr, ec] = std::from_chars(number, number_end, value);
+    if (ec != std::errc() || ptr != number_end) {
+        return false;
+    }
+
+    // "3/8", or "5 3/8" after a whole number.
+    auto fraction = [&](const char *at, double &result) -> const char * {
+        const char *num_end = digits(at);
+        if (num_end == at || num_end >= end || *num_end != '/' ||
+            !is_digit(num_end + 1)) {
+            return nullptr;
+        }
+        const char *den_end = digits(num_end + 1);
+        double num = 0.0, den = 0.0;
+        std::from_chars(at, num_end, num);
+        std::from_chars(num_end + 1, den_end, den);
+        if (den == 0.0) {
+            return nullptr;
+        }
+        result = num / den;
+        return den_end;
+    };
+    double part;
+    if (integer && !grouped && q < end && *q == '/') {
+        const char *after = fraction(int_begin, part);
+        if (after == nullptr) {
+            return false;
+        }
+        value = part;
+        q = after;
+    } else if (integer) {
+        const char *blank = q;
+        while (blank < end && (*blank == ' ' || *blank == '\t')) {
+            ++blank;
+        }
+        if (blank > q) {
+            if (const char *after = fraction(blank, part)) {
+                value += part;
+                q = after;
+            }
+        }
+    }
+
+    out = negative ? -value : value;
+    p = q;
+    return q > begin;
+}
+
+// Parses a quantity written as numbers each followed by its unit, such as
+// "5km", "3.2 lbs", "1,234.5 mL", "5 3/8 in" or "5 ft 3 in", into `plans`'
+// target unit. A bare number is read with `bare` (the -f plan) when there
+// is one. A sign is only allowed in front of the first number, and offsets
+// (temperatures) only when there is a single part. Units go through
+// `plans`, so after warm-up a row costs no allocation. The units as written
+// ("ft in") are appended to `units` when it is given.
+Expected<double> parse_quantity(std::string_view text, PlanCache &plans,
+                                const ConversionPlan *bare = nullptr,
+                                std::string *units = nullptr) {
+    const ConvertFailure bad_number{ConvertError::BadNumber, text};
+    const char *p = text.data();
+    const char *end = p + text.size();
+    auto skip_blanks = [&]() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            ++p;
+        }
+    };
+    auto is_alpha = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    };
+
+    double total = 0.0, offset = 0.0;
+    size_t parts = 0;
+    bool negative = false, offset_seen = false;
+    for (skip_blanks(); p < end; skip_blanks()) {
+        if (parts > 0 && (*p == '-' || *p == '+')) {
+            return bad_number;
+        }
+        double number;
+        if (!scan_number(p, end, number)) {
+            return bad_number;
+        }
+        if (parts == 0) {
+            negative = std::signbit(number);
+        }
+        skip_blanks();
+
+        // Letters, plus a trailing "3" for the cubic units ("2m3") unless a
+        // new number starts there ("5ft3in").
+        const char *unit = p;
+        while (p < end && is_alpha(*p)) {
+            ++p;
+        }
+        if (p < end && *p == '3' && p > unit &&
+            (p + 1 == end || !(is_alpha(p[1]) || p[1] == '.' ||
+                               (p[1] >= '0' && p[1] <= '9')))) {
+            ++p;
+        }
+        const ConversionPlan *plan = nullptr;
+        if (p > unit) {
+            Expected<const ConversionPlan *> found =
+                plans.find(std::string_view(unit, p - unit));
+            if (!found) {
+                return found.error();
+            }
+            plan = *found;
+            if (units != nullptr) {
+                *units += (units->empty() ? "" : " ") +
+                          normalize_unit(std::string(unit, p - unit));
+            }
+        } else if (parts == 0 && bare != nullptr) {
+            skip_blanks();
+            plan = p == end ? bare : nullptr;
+        }
+        if (plan == nullptr) {
+            return ConvertFailure{ConvertError::UnknownUnit, text};
+        }
+
+        total += (negative ? -std::fabs(number) : number) * plan->scale;
+        offset = plan->offset;
+        offset_seen = offset_seen || plan->offset != 0.0;
+        ++parts;
+    }
+
+    if (parts == 0 || (parts > 1 && offset_seen)) {
+        return bad_number;
+    }
+    return total + offset;
+}
+
+// Reads a row's value into the target unit: a plain number through
+// `fixed` (-f) or the row's unit column, otherwise as a quantity that
+// names its own units.
+Expected<double> row_value(const RowFields &fields,
+                           const ConversionPlan *fixed,
+                           const RowLayout &layout, PlanCache &plans) {
+    const char *begin = fields.value.data();
+    double value;
+    if (parse_number(begin, begin + fields.value.size(), value)) {
+        const ConversionPlan *plan = fixed;
+        if (plan == nullptr && layout.unit_col > 0) {
+            Expected<const ConversionPlan *> found = plans.find(fields.unit);
+            if (!found) {
+                return found.error();
+            }
+            plan = *found;
+        }
+        if (plan == nullptr) {
+            return ConvertFailure{ConvertError::UnknownUnit, fields.value};
+        }
+        return plan->apply(value);
+    }
+    return parse_quantity(fields.value, plans, fixed);
+}
+
+// Splits `line` and reads its value, or says why it could not.
+Expected<double> convert_row(std::string_view line,
+                             const ConversionPlan *fixed,
+                             const RowLayout &layout, PlanCache &plans,
+                             RowFields &fields) {
+    if (!split_row(line, layout, fields)) {
+        return ConvertFailure{ConvertError::ShortRow, line};
+    }
+    return row_value(fields, fixed, layout, plans);
+}
+
+struct AggregateOptions {
+    RowLayout layout;
+    bool stats{false};
+    bool groups{false};
+    size_t spill_groups{1 << 20};
+    unsigned jobs{1};
+};
+
+// Everything one worker accumulates over its share of the input.
+struct AggregateWorker {
+    StreamSketch sketch;
+    GroupTable groups;
+    GroupSpill spill;
+    RowErrors errors;
+};
+
+// Parses, converts and aggregates every row of `data` in a single pass:
+// each row is split once, converted once, and fed to the stream sketch and
+// the group table together. Workers keep private state and are merged once
+// all of them finish; group tables that outgrow `spill_groups` go through
+// the radix-partitioned spill instead. Groups are written to `group_out`.
+StreamSketch aggregate_stream(const std::string &from_unit,
+                              const std::string &to_unit,
+                              std::string_view data,
+                              const AggregateOptions &options,
+                              RowErrors &errors, std::ostream &group_out) {
+    const RowLayout &layout = options.layout;
+    std::optional<ConversionPlan> fixed_plan;
+    if (layout.unit_col == 0 && !from_unit.empty()) {
+        fixed_plan = make_plan(from_unit, to_unit);
+    }
+
+    auto ranges = split_lines(data, options.jobs);
+    std::vector<std::unique_ptr<AggregateWorker>> workers(ranges.size());
+
+    run_workers(ranges.size(), [&](size_t w) {
+        // Built by the worker, so its tables land on the worker's node.
+        workers[w] = std::make_unique<AggregateWorker>();
+        AggregateWorker &local = *workers[w];
+        PlanCache plans(to_unit);
+        auto [begin, end] = ranges[w];
+
+        for_each_line(data.substr(begin, end - begin), [&](std::string_view
+                                                               line) {
+            if (line.empty() || line == "\r") {
+                return;
+            }
+
+            RowFields fields;
+            Expected<double> value =
+                convert_row(line, fixed_plan ? &*fixed_plan : nullptr, layout,
+                            plans, fields);
+            if (!value) {
+                local.errors.add(value.error().code, line, OnError::Skip);
+                return;
+            }
+            double converted = *value;
+
+            if (options.stats) {
+                local.sketch.add(converted);
+            }
+            if (options.groups) {
+                local.groups.find_or_insert(fields.key, hash_key(fields.key))
+                    .add(converted);
+                if (local.groups.size() >= options.spill_groups) {
+                    local.spill.write(local.groups);
+                    local.groups.clear();
+                }
+            }
+        });
+    });
+
+    StreamSketch result;
+    result.unit = to_unit;
+    for (auto &worker : workers) {
+        worker->sketch.unit = to_unit;
+        result.merge(worker->sketch);
+        errors.merge(worker->errors);
+    }
+    errors.check(layout.max_errors);
+
+    if (!options.groups) {
+        return result;
+    }
+
+    bool spilled = std::any_of(workers.begin(), workers.end(),
+                               [](const auto &worker) {
+                                   return !worker->spill.empty();
+                               });
+    if (!spilled) {
+        GroupTable merged;
+        for (const auto &worker : workers) {
+            worker->groups.for_each([&](std::string_view key, uint64_t hash,
+                                       const GroupAggregate &aggregate) {
+                merged.find_or_insert(key, hash).merge(aggregate);
+            });
+        }
+        print_groups(merged, group_out);
+        return result;
+    }
+
+    // High-cardinality path: finish spilling, then merge one partition at a
+    // time. Output is sorted within each partition.
+    for (auto &worker : workers) {
+        worker->spill.write(worker->groups);
+        worker->groups.clear();
+    }
+    GroupTable partition;
+    for (size_t p = 0; p < GroupSpill::kPartitions; ++p) {
+        for (const auto &worker : workers) {
+            worker->spill.read(p, partition);
+        }
+        print_groups(partition, group_out);
+        partition.clear();
+    }
+    return result;
+}
+
+// Incremental tumbling/sliding window aggregation over timestamped rows.
+// Window k covers [k * slide, k * slide + size). Only windows that have
+// seen a row and are not yet closed are kept, and each one is emitted as
+// soon as the watermark (newest timestamp minus the allowed lateness)
+// passes its end.
+class WindowAggregator {
+  public:
+    WindowAggregator(const WindowOptions &options, std::ostream &out)
+        : options_(options), out_(out) {}
+
+    void add(double timestamp, double value) {
+        int64_t last = static_cast<int64_t>(
+            std::floor(timestamp / options_.slide));
+        int64_t first = static_cast<int64_t>(std::floor(
+                            (timestamp - options_.size) / options_.slide)) +
+                        1;
+        first = std::max(first, next_open_);
+        if (first > last) {
+            ++late_;
+            return;
+        }
+
+        for (int64_t k = first; k <= last; ++k) {
+            windows_[k].add(value);
+        }
+
+        if (timestamp > newest_) {
+            newest_ = timestamp;
+            close_until(newest_ - options_.lateness);
+        }
+    }
+
+    // Emits every window still open, e.g. at end of input.
+    void flush() {
+        close_until(std::numeric_limits<double>::infinity());
+    }
+
+    uint64_t late() const { return late_; }
+
+  private:
+    void close_until(double watermark) {
+        while (!windows_.empty()) {
+            auto it = windows_.begin();
+            double start = static_cast<double>(it->first) * options_.slide;
+            double end = start + options_.size;
+            if (end > watermark) {
+                break;
+            }
+            emit(start, end, it->second);
+            next_open_ = it->first + 1;
+            windows_.erase(it);
+        }
+
+        // Windows that never saw a row still close with the watermark.
+        if (std::isfinite(watermark)) {
+            int64_t closed = static_cast<int64_t>(std::floor(
+                (watermark - options_.size) / options_.slide));
+            next_open_ = std::max(next_open_, closed + 1);
+        }
+    }
+
+    void emit(double start, double end, const GroupAggregate &aggregate) {
+        auto precision = out_.precision(15);
+        out_ << start << '\t' << end << '\t';
+        out_.precision(precision);
+        out_ << aggregate.count << '\t' << aggregate.sum << '\t'
+             << aggregate.sum / static_cast<double>(aggregate.count) << '\t'
+             << aggregate.min << '\t' << aggregate.max << std::endl;
+    }
+
+    WindowOptions options_;
+    std::ostream &out_;
+    std::map<int64_t, GroupAggregate> windows_;
+    int64_t next_open_{std::numeric_limits<int64_t>::min()};
+    double newest_{-std::numeric_limits<double>::infinity()};
+    uint64_t late_{0};
+};
+
+// Reads rows from `in` as they arrive and feeds them to a window
+// aggregator, so results appear while the producer is still writing.
+void window_stream(const std::string &from_unit, const std::string &to_unit,
+                   const RowLayout &layout, const WindowOptions &options,
+                   std::istream &in, std::ostream &out) {
+    std::optional<ConversionPlan> fixed_plan;
+    if (layout.unit_col == 0 && !from_unit.empty()) {
+        fixed_plan = make_plan(from_unit, to_unit);
+    }
+    PlanCache plans(to_unit);
+    WindowAggregator windows(options, out);
+    RowErrors errors;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line == "\r") {
+            continue;
+        }
+
+        RowFields fields;
+        double timestamp;
+        Expected<double> value = convert_row(
+            line, fixed_plan ? &*fixed_plan : nullptr, layout, plans, fields);
+        if (value && !parse_number(fields.time.data(),
+                                   fields.time.data() + fields.time.size(),
+                                   timestamp)) {
+            value = ConvertFailure{ConvertError::BadNumber, fields.time};
+        }
+        if (!value) {
+            errors.add(value.error().code, line, OnError::Skip);
+            errors.check(layout.max_errors);
+            continue;
+        }
+
+        windows.add(timestamp, *value);
+    }
+    windows.flush();
+
+    errors.report(std::cerr);
+    if (windows.late() > 0) {
+        std::cerr << "Dropped " << windows.late()
+                  << " row(s) that arrived after their windows closed\n";
+    }
+}
+
+// Appends `value` to `out` the way iostreams print it by default (six
+// significant digits), without going through a stream.
+void append_number(std::string &out, double value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                std::chars_format::general, 6);
+    out.append(buffer, result.ptr);
+}
+
+// `--auto` output: rewrites a value in the target unit into the unit of the
+// same system that keeps it in [1, 1000) where the system allows. Each
+// ladder is ordered smallest unit first; `members` are the other units that
+// pick it as their system.
+struct AutoLadder {
+    std::vector<std::string> rungs;
+    std::vector<std::string> members;
+};
+
+const std::vector<AutoLadder> auto_ladders{
+    {{"mm", "m", "km"}, {"cm"}},
+    {{"in", "ft", "mi"}, {"yd"}},
+    {{"g", "kg"}, {}},
+    {{"oz", "lb"}, {}},
+    {{"uL", "mL", "L", "m3"}, {"ul", "ml", "l", "cc", "cm3"}},
+    {{"tsp", "floz", "gal"}, {"tbsp", "cup", "pt", "qt", "in3", "ft3"}},
+};
+
+// The ladder for one target unit, flattened into threshold and ratio tables
+// padded to a fixed width. Picking a rung counts how many thresholds the
+// magnitude reaches, so the per-value cost is a fixed run of compares and
+// adds with no branches, the same for every value.
+class AutoScale {
+  public:
+    static constexpr size_t kRungs = 4;
+
+    explicit AutoScale(const std::string &to_unit) {
+        threshold_.fill(std::numeric_limits<double>::infinity());
+        ratio_.fill(1.0);
+        units_.fill(to_unit);
+
+        for (const auto &ladder : auto_ladders) {
+            bool match = std::count(ladder.rungs.begin(), ladder.rungs.end(),
+                                    to_unit) > 0 ||
+                         std::count(ladder.members.begin(),
+                                    ladder.members.end(), to_unit) > 0;
+            if (!match) {
+                continue;
+            }
+            for (size_t r = 0; r < ladder.rungs.size(); ++r) {
+                // One rung unit is worth threshold_[r] target units.
+                threshold_[r] = convert(ladder.rungs[r], to_unit, 1.0);
+                ratio_[r] = convert(to_unit, ladder.rungs[r], 1.0);
+                units_[r] = ladder.rungs[r];
+            }
+            break;
+        }
+    }
+
+    // Rung for `value` (in the target unit): the largest unit it reaches
+    // one of, or the smallest when it reaches none.
+    size_t pick(double value) const {
+        double magnitude = std::fabs(value);
+        size_t rung = 0;
+        for (size_t r = 1; r < kRungs; ++r) {
+            rung += magnitude >= threshold_[r];
+        }
+        return rung;
+    }
+
+    double scale(double value, size_t rung) const {
+        return value * ratio_[rung];
+    }
+    const std::string &unit(size_t rung) const { return units_[rung]; }
+
+    // Appends `value` rescaled, a space and its unit.
+    void append(std::string &out, double value) const {
+        size_t rung = pick(value);
+        append_number(out, value * ratio_[rung]);
+        out += ' ';
+        out += units_[rung];
+    }
+
+  private:
+    std::array<double, kRungs> threshold_;
+    std::array<double, kRungs> ratio_;
+    std::array<std::string, kRungs> units_;
+};
+
+// `--split ft,in` output: a value in the target unit written as whole
+// counts of each listed unit, largest first, with the remainder in the
+// last one ("5 ft 3 in"). Everything is worked out in the last unit, with
+// the divisors fixed when the job starts.
+class SplitFormat {
+  public:
+    SplitFormat(const std::string &to_unit, const std::string &spec) {
+        size_t start = 0;
+        while (start <= spec.size()) {
+            size_t comma = spec.find(',', start);
+            if (comma == std::string::npos) {
+                comma = spec.size();
+            }
+            units_.push_back(
+                normalize_unit(spec.substr(start, comma - start)));
+            start = comma + 1;
+        }
+
+        const std::string &last = units_.back();
+        if (get_unit_category(last) == UnitCategory::Tempurature) {
+            throw std::invalid_argument("'--split' needs units without "
+                                        "an offset.");
+        }
+        ratio_ = convert(to_unit, last, 1.0); // also checks the category
+        for (const auto &unit : units_) {
+            widths_.push_back(convert(unit, last, 1.0));
+            if (widths_.size() > 1 && widths_.back() >= widths_.end()[-2]) {
+                throw std::invalid_argument(
+                    "'--split' units must go from largest to smallest.");
+            }
+        }
+    }
+
+    void append(std::string &out, double value) const {
+        // Round to a millionth of the last unit, so that e.g. 5.25 ft is
+        // 63 in and not 62.99999999999999 in.
+        double rest = std::round(std::fabs(value) * ratio_ * 1e6) / 1e6;
+        if (value < 0) {
+            out += '-';
+        }
+        for (size_t i = 0; i + 1 < units_.size(); ++i) {
+            double whole = std::floor(rest / widths_[i] + 1e-9);
+            rest = std::max(0.0, rest - whole * widths_[i]);
+
+            char buffer[32];
+            auto result =
+                std::to_chars(buffer, buffer + sizeof(buffer),
+                              static_cast<long long>(whole));
+            out.append(buffer, result.ptr);
+            out += ' ';
+            out += units_[i];
+            out += ' ';
+        }
+        append_number(out, rest);
+        out += ' ';
+        out += units_.back();
+    }
+
+  private:
+    std::vector<std::string> units_;
+    std::vector<double> widths_; // each unit, in the last unit
+    double ratio_{1.0};          // target unit -> last unit
+};
+
+// Writers for each `--format`, one specialization per format. A job builds
+// its writer once (make_row_writer) and the row loops are instantiated per
+// writer type, so formatting a row never tests which format is in use.
+// write() and missing() append one whole record, terminator included.
+template <OutputFormat F> struct RowWriter;
+
+// Text records end in the row separator; a missing value reads "nan".
+struct TextWriter {
+    char separator{'\n'};
+
+    void missing(std::string &out, std::string_view) const {
+        out += "nan";
+        out += separator;
+    }
+};
+
+// The historical output: six significant digits.
+template <> struct RowWriter<OutputFormat::Text> : TextWriter {
+    void write(std::string &out, double value, std::string_view) const {
+        append_number(out, value);
+        out += separator;
+    }
+};
+
+// --auto and --split are text too, but each gets its own writer so the row
+// loop is instantiated for it rather than testing for it per row.
+struct AutoScaleWriter : TextWriter {
+    AutoScale auto_scale;
+
+    void write(std::string &out, double value, std::string_view) const {
+        auto_scale.append(out, value);
+        out += separator;
+    }
+};
+
+struct SplitWriter : TextWriter {
+    SplitFormat split;
+
+    void write(std::string &out, double value, std::string_view) const {
+        split.append(out, value);
+        out += separator;
+    }
+};
+
+// "VALUE<delimiter>UNIT" per row; a missing value is an empty field.
+template <char Delimiter> struct DelimitedWriter {
+    void write(std::string &out, double value, std::string_view unit) const {
+        append_exact(out, value);
+        out += Delimiter;
+        out.append(unit.data(), unit.size());
+        out += '\n';
+    }
+    void missing(std::string &out, std::string_view unit) const {
+        out += Delimiter;
+        out.append(unit.data(), unit.size());
+        out += '\n';
+    }
+};
+
+template <>
+struct RowWriter<OutputFormat::Csv> : DelimitedWriter<','> {};
+template <>
+struct RowWriter<OutputFormat::Tsv> : DelimitedWriter<'\t'> {};
+
+// {"value":1.5,"unit":"km"}; JSON has no NaN, so missing values are null.
+// Unit names are plain ASCII and never need escaping.
+template <> struct RowWriter<OutputFormat::Jsonl> {
+    void write(std::string &out, double value, std::string_view unit) const {
+        if (!std::isfinite(value)) {
+            missing(out, unit);
+            return;
+        }
+        out += "{\"value\":";
+        append_exact(out, value);
+        end(out, unit);
+    }
+    void missing(std::string &out, std::string_view unit) const {
+        out += "{\"value\":null";
+        end(out, unit);
+    }
+
+  private:
+    static void end(std::string &out, std::string_view unit) {
+        out += ",\"unit\":\"";
+        out.append(unit.data(), unit.size());
+        out += "\"}\n";
+    }
+};
+
+// Fixed-width records of kWidth bytes: the value in scientific notation
+// with 17 significant digits (exact), right-aligned, then the unit padded
+// on the right. Record i starts at byte i * kWidth.
+template <> struct RowWriter<OutputFormat::Fixed> {
+    static constexpr size_t kValueWidth = 24;
+    static constexpr size_t kWidth = 32;
+
+    void write(std::string &out, double value, std::string_view unit) const {
+        char buffer[kValueWidth];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                    std::chars_format::scientific, 16);
+        pad(out, std::string_view(buffer, result.ptr - buffer), unit);
+    }
+    void missing(std::string &out, std::string_view unit) const {
+        pad(out, "nan", unit);
+    }
+
+  private:
+    static void pad(std::string &out, std::string_view value,
+                    std::string_view unit) {
+        unit = unit.substr(0, kWidth - kValueWidth - 2);
+        out.append(kValueWidth - value.size(), ' ');
+        out.append(value.data(), value.size());
+        out += ' ';
+        out.append(unit.data(), unit.size());
+        out.append(kWidth - kValueWidth - 2 - unit.size(), ' ');
+        out += '\n';
+    }
+};
+
+// Raw native-endian doubles, eight bytes per row; missing values are NaN.
+template <> struct RowWriter<OutputFormat::Binary> {
+    void write(std::string &out, double value, std::string_view) const {
+        char bytes[sizeof(double)];
+        std::memcpy(bytes, &value, sizeof(double));
+        out.append(bytes, sizeof(double));
+    }
+    void missing(std::string &out, std::string_view unit) const {
+        write(out, std::numeric_limits<double>::quiet_NaN(), unit);
+    }
+};
+
+using AnyRowWriter =
+    std::variant<RowWriter<OutputFormat::Text>, AutoScaleWriter, SplitWriter,
+                 RowWriter<OutputFormat::Csv>, RowWriter<OutputFormat::Tsv>,
+                 RowWriter<OutputFormat::Jsonl>,
+                 RowWriter<OutputFormat::Fixed>,
+                 RowWriter<OutputFormat::Binary>>;
+
+// The writer for `layout`'s format; results are in `unit`.
+AnyRowWriter make_row_writer(const RowLayout &layout,
+                             const std::string &unit) {
+    switch (layout.format) {
+    case OutputFormat::Text:
+        if (layout.auto_scale) {
+            return AutoScaleWriter{{layout.separator}, AutoScale(unit)};
+        }
+        if (!layout.split.empty()) {
+            return SplitWriter{{layout.separator},
+                               SplitFormat(unit, layout.split)};
+        }
+        return RowWriter<OutputFormat::Text>{{layout.separator}};
+    case OutputFormat::Csv:
+        return RowWriter<OutputFormat::Csv>{};
+    case OutputFormat::Tsv:
+        return RowWriter<OutputFormat::Tsv>{};
+    case OutputFormat::Jsonl:
+        return RowWriter<OutputFormat::Jsonl>{};
+    case OutputFormat::Fixed:
+        return RowWriter<OutputFormat::Fixed>{};
+    case OutputFormat::Binary:
+        return RowWriter<OutputFormat::Binary>{};
+    }
+    return RowWriter<OutputFormat::Text>{};
+}
+
+// The block loops of the record and template converters, compiled once per
+// instruction set. bind_kernels() picks the widest set the CPU supports
+// when the program starts (`--cpu` overrides it), so one binary runs at
+// full width on every node. Products and sums are kept as separate steps,
+// never fused, so every level writes the same bytes as the scalar loops.
+//
+// Row splitting already goes through memchr, which glibc dispatches the
+// same way; number parsing and formatting are scalar by nature.
+struct Kernels {
+    const char *name;
+    // values[i] = values[i] * scale + offset
+    void (*affine)(double *values, size_t n, double scale, double offset);
+    // sums[i] += factor * values[i]
+    void (*accumulate)(double *sums, const double *values, size_t n,
+                       double factor);
+};
+
+void affine_scalar(double *values, size_t n, double scale, double offset) {
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = values[i] * scale + offset;
+    }
+}
+
+void accumulate_scalar(double *sums, const double *values, size_t n,
+                       double factor) {
+    for (size_t i = 0; i < n; ++i) {
+        sums[i] += factor * values[i];
+    }
+}
+
+const Kernels scalar_kernels{"scalar", affine_scalar, accumulate_scalar};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2"))) void
+affine_avx2(double *values, size_t n, double scale, double offset) {
+    const __m256d s = _mm256_set1_pd(scale);
+    const __m256d o = _mm256_set1_pd(offset);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        _mm256_storeu_pd(values + i, _mm256_add_pd(_mm256_mul_pd(v, s), o));
+    }
+    affine_scalar(values + i, n - i, scale, offset);
+}
+
+__attribute__((target("avx2"))) void
+accumulate_avx2(double *sums, const double *values, size_t n,
+                double factor) {
+    const __m256d f = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d product = _mm256_mul_pd(f, _mm256_loadu_pd(values + i));
+        _mm256_storeu_pd(sums + i,
+                         _mm256_add_pd(_mm256_loadu_pd(sums + i), product));
+    }
+    accumulate_scalar(sums + i, values + i, n - i, factor);
+}
+
+// AVX-512F includes FMA, and C++ builds contract a * b + c by default, so
+// these use the explicitly rounded forms, which round like the plain ones
+// but are never fused, and finish with a masked step instead of a scalar
+// loop. (The zero-masked spellings also avoid a GCC 12 header warning.)
+__attribute__((target("avx512f"))) void
+affine_avx512(double *values, size_t n, double scale, double offset) {
+    const __m512d s = _mm512_set1_pd(scale);
+    const __m512d o = _mm512_set1_pd(offset);
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 lanes = n - i >= 8 ? 0xff : (1u << (n - i)) - 1;
+        __m512d v = _mm512_maskz_loadu_pd(lanes, values + i);
+        v = _mm512_maskz_mul_round_pd(lanes, v, s, _MM_FROUND_CUR_DIRECTION);
+        v = _mm512_maskz_add_round_pd(lanes, v, o, _MM_FROUND_CUR_DIRECTION);
+        _mm512_mask_storeu_pd(values + i, lanes, v);
+    }
+}
+
+__attribute__((target("avx512f"))) void
+accumulate_avx512(double *sums, const double *values, size_t n,
+                  double factor) {
+    const __m512d f = _mm512_set1_pd(factor);
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 lanes = n - i >= 8 ? 0xff : (1u << (n - i)) - 1;
+        __m512d product = _mm512_maskz_mul_round_pd(
+            lanes, f, _mm512_maskz_loadu_pd(lanes, values + i),
+            _MM_FROUND_CUR_DIRECTION);
+        __m512d sum = _mm512_maskz_add_round_pd(
+            lanes, _mm512_maskz_loadu_pd(lanes, sums + i), product,
+            _MM_FROUND_CUR_DIRECTION);
+        _mm512_mask_storeu_pd(sums + i, lanes, sum);
+    }
+}
+
+const Kernels avx2_kernels{"avx2", affine_avx2, accumulate_avx2};
+const Kernels avx512_kernels{"avx512", affine_avx512, accumulate_avx512};
+#endif
+
+// Bound by bind_kernels() before any worker starts; read-only after.
+const Kernels *kernels = &scalar_kernels;
+
+// The levels this CPU can run, narrowest first.
+std::vector<const Kernels *> supported_kernels() {
+    std::vector<const Kernels *> supported{&scalar_kernels};
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        supported.push_back(&avx2_kernels);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        supported.push_back(&avx512_kernels);
+    }
+#endif
+    return supported;
+}
+
+// `level` is "auto" or one of the kernel names; asking for a level this
+// CPU cannot run is an error rather than a silent fallback.
+void bind_kernels(const std::string &level) {
+    std::vector<const Kernels *> supported = supported_kernels();
+    if (level == "auto") {
+        kernels = supported.back();
+        return;
+    }
+    for (const Kernels *candidate : supported) {
+        if (level == candidate->name) {
+            kernels = candidate;
+            return;
+        }
+    }
+    throw std::invalid_argument("This CPU cannot run '--cpu " + level +
+                                "' (auto, scalar, avx2, avx512).");
+}
+
+// Converts `VALUE FROM TO` records, where every row names its own units
+// (fields separated by spaces, tabs or commas). Each distinct unit
+// spelling is interned once into a small id and each id pair into a plan,
+// so after warm-up a record costs two table probes. Whole blocks are then
+// bucketed by pair, each bucket is converted in one tight affine loop, and
+// results are scattered back into input order: a file that mixes many
+// pairs runs the same inner loop as a single-pair one.
+class RecordConverter {
+  public:
+    static constexpr size_t kBlock = 4096;
+
+    // Parses one record and converts it on its own.
+    Expected<double> convert_one(std::string_view record) {
+        double value;
+        int plan;
+        ConvertError why = parse_record(record, value, plan);
+        if (plan < 0) {
+            return ConvertFailure{why, record};
+        }
+        return plans_[plan].apply(value);
+    }
+
+    // Converts every record of `data` (ended by `separator`), handing each
+    // result to `writer`. Bad records are dropped, or kept in place as
+    // missing values under OnError::Nan.
+    template <typename Writer>
+    void convert_block(std::string_view data, char separator,
+                       std::string &out, RowErrors &errors, OnError policy,
+                       const Writer &writer) {
+        size_t n = 0;
+        auto flush = [&] {
+            convert_grouped(n);
+            for (size_t i = 0; i < n; ++i) {
+                if (plan_of_[i] >= 0) {
+                    writer.write(out, values_[i],
+                                 units_[plan_to_[plan_of_[i]]]);
+                } else {
+                    writer.missing(out, {});
+                }
+            }
+            n = 0;
+        };
+
+        for_each_line(
+            data,
+            [&](std::string_view record) {
+                if (record.empty() || record == "\r") {
+                    return;
+                }
+                int plan = -1;
+                ConvertError why = parse_record(record, values_[n], plan);
+                if (plan < 0) {
+                    errors.add(why, record, policy);
+                    if (policy != OnError::Nan) {
+                        return;
+                    }
+                }
+                plan_of_[n] = plan;
+                if (++n == kBlock) {
+                    flush();
+                }
+            },
+            separator);
+        flush();
+    }
+
+  private:
+    static std::string_view next_field(std::string_view &rest) {
+        size_t begin = rest.find_first_not_of(" \t,\r");
+        if (begin == std::string_view::npos) {
+            rest = {};
+            return {};
+        }
+        size_t end = rest.find_first_of(" \t,\r", begin);
+        if (end == std::string_view::npos) {
+            end = rest.size();
+        }
+        std::string_view field = rest.substr(begin, end - begin);
+        rest.remove_prefix(end);
+        return field;
+    }
+
+    // Sets `plan` to -1 and returns the reason when the record is bad.
+    ConvertError parse_record(std::string_view record, double &value,
+                              int &plan) {
+        plan = -1;
+        std::string_view text = next_field(record);
+        std::string_view from = next_field(record);
+        std::string_view to = next_field(record);
+        if (to.empty()) {
+            return ConvertError::ShortRow;
+        }
+        if (!parse_number(text.data(), text.data() + text.size(), value)) {
+            return ConvertError::BadNumber;
+        }
+        return plan_for(intern(from), intern(to), plan);
+    }
+
+    // Maps a unit spelling to the id of its canonical unit. Unit names fit
+    // the small-string buffer, so lookups do not allocate.
+    int intern(std::string_view spelling) {
+        auto it = spellings_.find(std::string(spelling));
+        if (it != spellings_.end()) {
+            return it->second;
+        }
+
+        std::string canonical = normalize_unit(std::string(spelling));
+        auto found = std::find(units_.begin(), units_.end(), canonical);
+        int id = static_cast<int>(found - units_.begin());
+        if (found == units_.end()) {
+            units_.push_back(canonical);
+        }
+        spellings_.emplace(std::string(spelling), id);
+        return id;
+    }
+
+    // Sets `plan` to the pair's plan id, or to -1 and returns why the pair
+    // has none. Failed pairs are remembered as -1 - reason.
+    ConvertError plan_for(int from, int to, int &plan) {
+        uint64_t key = static_cast<uint64_t>(from) << 32 |
+                       static_cast<uint32_t>(to);
+        auto it = pairs_.find(key);
+        if (it == pairs_.end()) {
+            Expected<ConversionPlan> made =
+                try_make_plan(units_[from], units_[to]);
+            int id = -1 - static_cast<int>(made.error().code);
+            if (made) {
+                plans_.push_back(*made);
+                plan_to_.push_back(to);
+                id = static_cast<int>(plans_.size() - 1);
+            }
+            it = pairs_.emplace(key, id).first;
+        }
+        plan = std::max(it->second, -1);
+        return it->second < 0 ? static_cast<ConvertError>(-1 - it->second)
+                              : ConvertError::BadNumber;
+    }
+
+    // Counting-sorts the first `n` records by plan, converts each plan's
+    // run in one loop, and writes the results back in place.
+    void convert_grouped(size_t n) {
+        size_t plans = plans_.size();
+        starts_.assign(plans + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            if (plan_of_[i] >= 0) {
+                ++starts_[plan_of_[i] + 1];
+            }
+        }
+        for (size_t p = 0; p < plans; ++p) {
+            starts_[p + 1] += starts_[p];
+        }
+
+        cursor_.assign(starts_.begin(), starts_.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+            if (plan_of_[i] >= 0) {
+                size_t slot = cursor_[plan_of_[i]]++;
+                gathered_[slot] = values_[i];
+                origin_[slot] = static_cast<uint32_t>(i);
+            }
+        }
+
+        for (size_t p = 0; p < plans; ++p) {
+            kernels->affine(gathered_.data() + starts_[p],
+                            starts_[p + 1] - starts_[p], plans_[p].scale,
+                            plans_[p].offset);
+        }
+
+        for (size_t k = 0; k < starts_[plans]; ++k) {
+            values_[origin_[k]] = gathered_[k];
+        }
+    }
+
+    std::unordered_map<std::string, int> spellings_;
+    std::vector<std::string> units_;
+    std::unordered_map<uint64_t, int> pairs_;
+    std::vector<ConversionPlan> plans_;
+    std::vector<int> plan_to_; // target unit id of each plan
+
+    std::array<double, kBlock> values_{};
+    std::array<int, kBlock> plan_of_{};
+    std::array<double, kBlock> gathered_{};
+    std::array<uint32_t, kBlock> origin_{};
+    std::vector<size_t> starts_;
+    std::vector<size_t> cursor_;
+};
+
+// A compiled unit expression: `constant + sum(coefficient * $column)`, in
+// `unit`. Every supported unit is affine and columns only ever get scaled
+// and added, so any expression the parser accepts folds into this form.
+struct ExpressionProgram {
+    double constant{0.0};
+    std::vector<std::pair<size_t, double>> terms; // 1-based column, factor
+    std::string unit; // empty for a plain number
+};
+
+// Recursive-descent compiler for expressions such as
+// "3 km + 200 m - 0.5 mi in ft" or "$1 lb + $2 oz in kg". Quantities are
+// folded into the category's base unit as they are parsed, dimensions are
+// checked on every operator, and the final `in UNIT` (or `to UNIT`) scales
+// the result once. Errors are reported when compiling, never per row.
+class ExpressionCompiler {
+  public:
+    explicit ExpressionCompiler(std::string_view text,
+                                PlanRegistry *registry = nullptr)
+        : text_(text), p_(text.data()), end_(text.data() + text.size()),
+          registry_(registry) {}
+
+    // Compiles the whole text; without `in UNIT` the result is given in
+    // `default_unit`, or else in the first unit the expression mentions.
+    ExpressionProgram compile(const std::string &default_unit) {
+        Linear value = parse_sum();
+
+        std::string target;
+        size_t mark = pos();
+        std::string word = identifier();
+        if (word == "in" || word == "to") {
+            target = unit_name(identifier(), true);
+        } else {
+            seek(mark);
+        }
+        skip_blanks();
+        if (p_ != end_) {
+            fail("unexpected '" + std::string(p_, end_) + "'");
+        }
+
+        ExpressionProgram program;
+        if (value.category == UnitCategory::Unknown) {
+            if (!target.empty()) {
+                fail("a plain number has no unit to convert to " + target);
+            }
+            program.constant = value.constant;
+        } else {
+            if (target.empty()) {
+                target = default_unit.empty() ? first_unit_ : default_unit;
+            }
+            if (get_unit_category(target) != value.category) {
+                fail("result cannot be converted to " + target);
+            }
+            ConversionPlan plan = resolve(base_unit(value.category), target);
+            program.constant = plan.apply(value.constant);
+            for (double &factor : value.factors) {
+                factor *= plan.scale;
+            }
+            program.unit = target;
+        }
+        for (size_t col = 0; col < value.factors.size(); ++col) {
+            if (value.factors[col] != 0.0) {
+                program.terms.emplace_back(col + 1, value.factors[col]);
+            }
+        }
+        return program;
+    }
+
+  private:
+    // A partial result in the base unit of `category` (Unknown for a plain
+    // number): constant + factors[i] * $(i + 1).
+    struct Linear {
+        double constant{0.0};
+        std::vector<double> factors;
+        UnitCategory category{UnitCategory::Unknown};
+        bool offset{false}; // a temperature, which cannot be scaled or added
+
+        bool has_columns() const {
+            return std::any_of(factors.begin(), factors.end(),
+                               [](double f) { return f != 0.0; });
+        }
+    };
+
+    [[noreturn]] void fail(const std::string &what) const {
+        throw std::invalid_argument("In '" + std::string(text_) +
+                                    "': " + what + ".");
+    }
+
+    static const char *base_unit(UnitCategory category) {
+        switch (category) {
+        case UnitCategory::Length:
+            return "m";
+        case UnitCategory::Mass:
+            return "kg";
+        case UnitCategory::Volume:
+            return "L";
+        default:
+            return "C";
+        }
+    }
+
+    ConversionPlan resolve(const std::string &from_unit,
+                           const std::string &to_unit) {
+        return registry_ ? registry_->get(from_unit, to_unit)
+                         : make_plan(from_unit, to_unit);
+    }
+
+    size_t pos() const { return static_cast<size_t>(p_ - text_.data()); }
+    void seek(size_t mark) { p_ = text_.data() + mark; }
+
+    void skip_blanks() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t')) {
+            ++p_;
+        }
+    }
+
+    bool accept(char c) {
+        skip_blanks();
+        if (p_ < end_ && *p_ == c) {
+            ++p_;
+            return true;
+        }
+        return false;
+    }
+
+    // Letters followed by digits ("km", "m3"), or "" if none start here.
+    std::string identifier() {
+        skip_blanks();
+        const char *begin = p_;
+        while (p_ < end_ && std::isalpha(static_cast<unsigned char>(*p_))) {
+            ++p_;
+        }
+        while (p_ > begin && p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+            ++p_;
+        }
+        return std::string(begin, p_);
+    }
+
+    std::string unit_name(const std::string &word, bool required) {
+        if (word.empty()) {
+            if (required) {
+                fail("expected a unit");
+            }
+            return word;
+        }
+        std::string unit = normalize_unit(word);
+        if (get_unit_category(unit) == UnitCategory::Unknown) {
+            fail("unknown unit '" + word + "'");
+        }
+        return unit;
+    }
+
+    // The unit after a number or column, if any. "in" is the conversion
+    // keyword rather than inches when a last unit ends the text after it;
+    // "to" always is.
+    std::string unit_suffix() {
+        size_t mark = pos();
+        std::string word = identifier();
+        if (word == "to") {
+            seek(mark);
+            return "";
+        }
+        if (word == "in") {
+            size_t after = pos();
+            bool keyword = !identifier().empty();
+            skip_blanks();
+            keyword = keyword && p_ == end_;
+            seek(keyword ? mark : after);
+            if (keyword) {
+                return "";
+            }
+        }
+        return unit_name(word, false);
+    }
+
+    // `scale * x` for x in `unit`, as a Linear in the base unit.
+    Linear quantity(double scale, size_t column, const std::string &unit) {
+        Linear result;
+        if (column > 0) {
+            result.factors.assign(column, 0.0);
+        }
+        if (unit.empty()) {
+            (column > 0 ? result.factors[column - 1] : result.constant) =
+                scale;
+            return result;
+        }
+
+        if (first_unit_.empty()) {
+            first_unit_ = unit;
+        }
+        result.category = get_unit_category(unit);
+        ConversionPlan plan = resolve(unit, base_unit(result.category));
+        result.offset = result.category == UnitCategory::Tempurature;
+        if (column > 0) {
+            result.factors[column - 1] = scale * plan.scale;
+            result.constant = plan.offset;
+        } else {
+            result.constant = plan.apply(scale);
+        }
+        return result;
+    }
+
+    Linear parse_primary() {
+        skip_blanks();
+        if (accept('(')) {
+            Linear inner = parse_sum();
+            if (!accept(')')) {
+                fail("missing ')'");
+            }
+            return inner;
+        }
+        if (accept('$')) {
+            size_t column = 0;
+            auto [next, ec] = std::from_chars(p_, end_, column);
+            if (ec != std::errc() || column == 0) {
+                fail("columns are written $1, $2, ...");
+            }
+            p_ = next;
+            return quantity(1.0, column, unit_suffix());
+        }
+
+        double number;
+        if (p_ == end_ || !scan_number(p_, end_, number)) {
+            fail(p_ == end_ ? "expression ends too early"
+                            : "expected a number at '" +
+                                  std::string(p_, end_) + "'");
+        }
+        return quantity(number, 0, unit_suffix());
+    }
+
+    Linear parse_unary() {
+        skip_blanks();
+        // A sign right before a digit belongs to the number ("-5 C").
+        bool signed_number = end_ - p_ > 1 && (*p_ == '-' || *p_ == '+') &&
+                             p_[1] >= '0' && p_[1] <= '9';
+        if (!signed_number && accept('-')) {
+            Linear value = parse_unary();
+            if (value.offset) {
+                fail("temperatures cannot be negated");
+            }
+            scale(value, -1.0);
+            return value;
+        }
+        accept('+');
+        return parse_primary();
+    }
+
+    static void scale(Linear &value, double by) {
+        value.constant *= by;
+        for (double &factor : value.factors) {
+            factor *= by;
+        }
+    }
+
+    Linear parse_product() {
+        Linear left = parse_unary();
+        while (true) {
+            bool multiply = accept('*');
+            if (!multiply && !accept('/')) {
+                return left;
+            }
+            Linear right = parse_unary();
+            if (left.offset || right.offset) {
+                fail("temperatures cannot be scaled");
+            }
+            if (!multiply) {
+                if (right.category != UnitCategory::Unknown ||
+                    right.has_columns()) {
+                    fail("can only divide by a plain number");
+                }
+                if (right.constant == 0.0) {
+                    fail("division by zero");
+                }
+                scale(left, 1.0 / right.constant);
+                continue;
+            }
+
+            if (left.category != UnitCategory::Unknown &&
+                right.category != UnitCategory::Unknown) {
+                fail("cannot multiply two quantities");
+            }
+            if (left.has_columns() && right.has_columns()) {
+                fail("cannot multiply two columns");
+            }
+            if (left.has_columns()) {
+                std::swap(left, right);
+            }
+            // left is a constant now; scale right by it.
+            UnitCategory category = left.category != UnitCategory::Unknown
+                                        ? left.category
+                                        : right.category;
+            scale(right, left.constant);
+            right.category = category;
+            left = std::move(right);
+        }
+    }
+
+    Linear parse_sum() {
+        Linear left = parse_product();
+        while (true) {
+            bool add = accept('+');
+            if (!add && !accept('-')) {
+                return left;
+            }
+            Linear right = parse_product();
+            if (left.category != right.category) {
+                fail("cannot add quantities of different kinds");
+            }
+            if (left.offset || right.offset) {
+                fail("temperatures cannot be added");
+            }
+            if (!add) {
+                scale(right, -1.0);
+            }
+            left.constant += right.constant;
+            if (right.factors.size() > left.factors.size()) {
+                left.factors.resize(right.factors.size(), 0.0);
+            }
+            for (size_t i = 0; i < right.factors.size(); ++i) {
+                left.factors[i] += right.factors[i];
+            }
+        }
+    }
+
+    std::string_view text_;
+    const char *p_;
+    const char *end_;
+    PlanRegistry *registry_;
+    std::string first_unit_;
+};
+
+ExpressionProgram compile_expression(std::string_view text,
+                                     const std::string &default_unit,
+                                     PlanRegistry *registry = nullptr) {
+    return ExpressionCompiler(text, registry).compile(default_unit);
+}
+
+// Applies a column template to delimited rows. Blocks of rows are parsed
+// into one array per referenced column, then the fused form is evaluated
+// a column at a time over the whole block, so the arithmetic runs as plain
+// multiply-add loops however long the expression was.
+class ExpressionConverter {
+  public:
+    static constexpr size_t kBlock = 4096;
+
+    ExpressionConverter(ExpressionProgram program, char delimiter)
+        : program_(std::move(program)), delimiter_(delimiter),
+          columns_(program_.terms.size()) {
+        for (auto &column : columns_) {
+            column.resize(kBlock);
+        }
+    }
+
+    const std::string &unit() const { return program_.unit; }
+
+    // Evaluates one row on its own.
+    Expected<double> convert_one(std::string_view row) {
+        ConvertError why;
+        if (!parse_row(row, 0, why)) {
+            return ConvertFailure{why, row};
+        }
+        double result = program_.constant;
+        for (size_t t = 0; t < program_.terms.size(); ++t) {
+            result += program_.terms[t].second * columns_[t][0];
+        }
+        return result;
+    }
+
+    // Evaluates every row of `data` (ended by `separator`), handing each
+    // result to `writer`. Bad rows are dropped, or kept in place as missing
+    // values under OnError::Nan.
+    template <typename Writer>
+    void convert_block(std::string_view data, char separator,
+                       std::string &out, RowErrors &errors, OnError policy,
+                       const Writer &writer) {
+        size_t n = 0;
+        auto flush = [&] {
+            double *results = results_.data();
+            std::fill(results, results + n, program_.constant);
+            for (size_t t = 0; t < program_.terms.size(); ++t) {
+                kernels->accumulate(results, columns_[t].data(), n,
+                                    program_.terms[t].second);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (valid_[i]) {
+                    writer.write(out, results[i], program_.unit);
+                } else {
+                    writer.missing(out, program_.unit);
+                }
+            }
+            n = 0;
+        };
+
+        for_each_line(
+            data,
+            [&](std::string_view row) {
+                if (row.empty() || row == "\r") {
+                    return;
+                }
+                ConvertError why;
+                valid_[n] = parse_row(row, n, why);
+                if (!valid_[n]) {
+                    errors.add(why, row, policy);
+                    if (policy != OnError::Nan) {
+                        return;
+                    }
+                }
+                if (++n == kBlock) {
+                    flush();
+                }
+            },
+            separator);
+        flush();
+    }
+
+  private:
+    // Stores the row's referenced columns at `slot`; terms are sorted by
+    // column, so one pass over the fields finds them all.
+    bool parse_row(std::string_view row, size_t slot, ConvertError &why) {
+        size_t col = 1, pos = 0, t = 0;
+        while (t < program_.terms.size() && pos <= row.size()) {
+            size_t next = row.find(delimiter_, pos);
+            if (next == std::string_view::npos) {
+                next = row.size();
+            }
+            for (; t < program_.terms.size() && program_.terms[t].first == col;
+                 ++t) {
+                if (!parse_number(row.data() + pos, row.data() + next,
+                                  columns_[t][slot])) {
+                    why = ConvertError::BadNumber;
+                    return false;
+                }
+            }
+            pos = next + 1;
+            ++col;
+        }
+        why = ConvertError::ShortRow;
+        return t == program_.terms.size();
+    }
+
+    ExpressionProgram program_;
+    char delimiter_;
+    std::vector<std::vector<double>> columns_;
+    std::array<double, kBlock> results_{};
+    std::array<bool, kBlock> valid_{};
+};
+
+// 64-bit hash over arbitrary bytes, eight at a time (a multiply-xorshift
+// mix in the style of MurmurHash's finalizer).
+uint64_t hash_bytes(std::string_view data, uint64_t seed) {
+    const uint64_t k = 0x9ddfea08eb382d69ull;
+    uint64_t hash = seed ^ (data.size() * k);
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, 8);
+        hash = (hash ^ (word * k)) * k;
+        hash ^= hash >> 47;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data.data() + i, data.size() - i);
+    hash = (hash ^ (tail * k)) * k;
+    hash ^= hash >> 47;
+    hash *= k;
+    hash ^= hash >> 47;
+    return hash;
+}
+
+// `--memo`: remembers the output record of recently seen rows, so a row
+// that repeats (quantized sensor data repeats a few thousand readings
+// millions of times) costs a hash and a copy instead of a parse, a
+// conversion and formatting. The table is direct-mapped and bounded; rows
+// and records too long for a slot are not remembered. Every kWindow
+// lookups the hit rate is checked, and below 1 in kMinHitRate the memo
+// switches itself off for kRetry rows before trying again.
+class OutputMemo {
+  public:
+    static constexpr size_t kSlots = 4096;
+    static constexpr size_t kKeyBytes = 22;
+    static constexpr size_t kRecordBytes = 32;
+    static constexpr uint32_t kWindow = 1 << 14;
+    static constexpr uint32_t kMinHitRate = 4;
+    static constexpr uint32_t kRetry = 1 << 20;
+
+    OutputMemo() : slots_(kSlots) {}
+
+    // Whether rows should be looked up at all right now.
+    bool active() {
+        if (enabled_) {
+            return true;
+        }
+        if (--idle_ == 0) {
+            enabled_ = true;
+        }
+        return false;
+    }
+
+    // Appends the remembered record of `row` to `out` and returns true, or
+    // returns false and keeps the slot for remember().
+    bool find(std::string_view row, std::string &out) {
+        slot_ = nullptr;
+        if (row.size() > kKeyBytes) {
+            return false;
+        }
+        if (++lookups_ == kWindow) {
+            if (hits_ * kMinHitRate < kWindow) {
+                enabled_ = false;
+                idle_ = kRetry;
+            }
+            lookups_ = hits_ = 0;
+        }
+
+        uint64_t hash = hash_bytes(row, 0);
+        Slot &slot = slots_[hash & (kSlots - 1)];
+        if (slot.hash == hash && slot.key_size == row.size() &&
+            std::memcmp(slot.key, row.data(), row.size()) == 0) {
+            ++hits_;
+            out.append(slot.record, slot.record_size);
+            return true;
+        }
+        slot_ = &slot;
+        hash_ = hash;
+        return false;
+    }
+
+    // Stores `record` as the output of `row`, the row of the last miss.
+    void remember(std::string_view row, std::string_view record) {
+        if (!slot_ || record.size() > kRecordBytes) {
+            return;
+        }
+        slot_->hash = hash_;
+        slot_->key_size = static_cast<uint8_t>(row.size());
+        slot_->record_size = static_cast<uint8_t>(record.size());
+        std::memcpy(slot_->key, row.data(), row.size());
+        std::memcpy(slot_->record, record.data(), record.size());
+    }
+
+  private:
+    struct Slot {
+        uint64_t hash{0};
+        uint8_t key_size{0xff}; // matches no row until filled
+        uint8_t record_size{0};
+        char key[kKeyBytes];
+        char record[kRecordBytes];
+    };
+
+    std::vector<Slot> slots_;
+    Slot *slot_{nullptr};
+    uint64_t hash_{0};
+    uint32_t lookups_{0};
+    uint32_t hits_{0};
+    uint32_t idle_{0};
+    bool enabled_{true};
+};
+
+// Converts rows into output records. Plans are resolved once and kept for
+// the life of the converter, so long-running modes never go back to the
+// unit maps.
+class LineConverter {
+  public:
+    LineConverter(const std::string &from_unit, const std::string &to_unit,
+                  const RowLayout &layout)
+        : layout_(layout), plans_(to_unit) {
+        std::string result_unit = to_unit;
+        if (!layout.expression.empty()) {
+            expression_.emplace(compile_expression(layout.expression, to_unit),
+                                layout.delimiter);
+            result_unit = expression_->unit();
+        } else if (layout.unit_col == 0 && !layout.records &&
+                   !from_unit.empty()) {
+            // Without -f every row has to name its units ("5 ft 3 in").
+            fixed_plan_ = make_plan(from_unit, to_unit);
+        }
+        unit_ = result_unit;
+        writer_ = make_row_writer(layout, result_unit);
+        if (layout.memo) {
+            memo_ = std::make_unique<OutputMemo>();
+        }
+    }
+
+    // Converts every row of `data`, appending one record per row in the
+    // job's output format. Bad rows are counted in `errors` and handled by
+    // the layout's policy. The format is resolved here, once per call.
+    void convert_rows(std::string_view data, std::string &out,
+                      RowErrors &errors) {
+        std::visit(
+            [&](const auto &writer) {
+                if (layout_.records) {
+                    records_.convert_block(data, layout_.separator, out,
+                                           errors, layout_.on_error, writer);
+                } else if (expression_) {
+                    expression_->convert_block(data, layout_.separator, out,
+                                               errors, layout_.on_error,
+                                               writer);
+                } else {
+                    convert_lines(data, out, errors, writer);
+                }
+            },
+            writer_);
+    }
+
+  private:
+    template <typename Writer>
+    void convert_lines(std::string_view data, std::string &out,
+                       RowErrors &errors, const Writer &writer) {
+        const ConversionPlan *fixed = fixed_plan_ ? &*fixed_plan_ : nullptr;
+        RowFields fields;
+        for_each_line(
+            data,
+            [&](std::string_view line) {
+                if (line.empty() || line == "\r") {
+                    return;
+                }
+                bool memo = memo_ && memo_->active();
+                if (memo && memo_->find(line, out)) {
+                    return;
+                }
+                Expected<double> value =
+                    convert_row(line, fixed, layout_, plans_, fields);
+                if (value) {
+                    size_t start = out.size();
+                    writer.write(out, *value, unit_);
+                    if (memo) {
+                        memo_->remember(line,
+                                        std::string_view(out).substr(start));
+                    }
+                    return;
+                }
+                errors.add(value.error().code, line, layout_.on_error);
+                if (layout_.on_error == OnError::Nan) {
+                    writer.missing(out, unit_);
+                }
+            },
+            layout_.separator);
+    }
+
+    RowLayout layout_;
+    std::string unit_;
+    std::optional<ConversionPlan> fixed_plan_;
+    AnyRowWriter writer_;
+    std::unique_ptr<OutputMemo> memo_;
+    std::optional<ExpressionConverter> expression_;
+    PlanCache plans_;
+    RecordConverter records_;
+};
+
+// Converts every complete line in `data` into `out`, returning how many
+// bytes were consumed; a trailing partial line is left for the next call.
+size_t convert_complete_lines(LineConverter &converter, std::string_view data,
+                              std::string &out, RowErrors &errors) {
+    size_t end = data.rfind('\n');
+    if (end == std::string_view::npos) {
+        return 0;
+    }
+
+    converter.convert_rows(data.substr(0, end + 1), out, errors);
+    return end + 1;
+}
+
+std::string system_error_message(const std::string &what) {
+    return what + ": " + std::strerror(errno);
+}
+
+// Writes `contents` to `path` through a temporary file and rename(), so a
+// crash leaves either the old or the new file, never a torn one. The
+// temporary name is unique to this process and call, so writers racing on
+// one path (shared caches and spools, threads) never share a temp file.
+void write_file_atomically(const std::string &path,
+                           const std::string &contents) {
+    static std::atomic<uint64_t> next_temp{0};
+    std::string temp = path + ".tmp." + std::to_string(::getpid()) + "." +
+                       std::to_string(next_temp++);
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0644);
+    if (fd < 0) {
+        throw std::runtime_error(system_error_message("Cannot write " + temp));
+    }
+    bool ok = ::write(fd, contents.data(), contents.size()) ==
+              static_cast<ssize_t>(contents.size());
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::string message = system_error_message("Cannot write " + path);
+        ::unlink(temp.c_str());
+        throw std::runtime_error(message);
+    }
+}
+
+// `xcvt --follow`: converts a growing file like `tail -f`. inotify wakes
+// the loop only when the file (or its directory, for rotation) changes.
+// Rotation by rename or delete is handled by draining the old file and
+// reopening the path; copy-truncate rotation is seen as the size dropping
+// below the read offset. With a state file, the inode and offset of the
+// last fully converted line are persisted so a restart picks up there.
+class FileFollower {
+  public:
+    FileFollower(std::string path, std::string state_path,
+                 LineConverter &converter, std::ostream &out,
+                 const RowLayout &layout)
+        : path_(std::move(path)), state_path_(std::move(state_path)),
+          converter_(converter), out_(out), on_error_(layout.on_error),
+          max_errors_(layout.max_errors) {}
+
+    ~FileFollower() {
+        close_file();
+        if (inotify_ >= 0) {
+            ::close(inotify_);
+        }
+    }
+
+    [[noreturn]] void run() {
+        inotify_ = inotify_init1(IN_CLOEXEC);
+        if (inotify_ < 0) {
+            throw std::runtime_error(system_error_message("inotify_init1"));
+        }
+
+        size_t slash = path_.rfind('/');
+        std::string dir = slash == std::string::npos
+                              ? "."
+                              : path_.substr(0, std::max<size_t>(slash, 1));
+        name_ = slash == std::string::npos ? path_ : path_.substr(slash + 1);
+        dir_watch_ =
+            inotify_add_watch(inotify_, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+        if (dir_watch_ < 0) {
+            throw std::runtime_error(system_error_message("Cannot watch " +
+                                                          dir));
+        }
+
+        load_state();
+        open_file();
+        drain();
+
+        alignas(inotify_event) char events[4096];
+        while (true) {
+            ssize_t got = ::read(inotify_, events, sizeof(events));
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(system_error_message("inotify"));
+            }
+
+            bool replaced = false;
+            for (ssize_t pos = 0; pos < got;) {
+                auto *event = reinterpret_cast<inotify_event *>(events + pos);
+                if (event->wd == file_watch_ &&
+                    (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+                    replaced = true;
+                }
+                if (event->wd == dir_watch_ && event->len > 0 &&
+                    name_ == event->name) {
+                    replaced = true;
+                }
+                pos += sizeof(inotify_event) + event->len;
+            }
+
+            drain();
+            if (replaced) {
+                reopen_if_replaced();
+            }
+        }
+    }
+
+  private:
+    void load_state() {
+        std::ifstream in(state_path_);
+        if (state_path_.empty() || !in) {
+            return;
+        }
+        uint64_t inode = 0, offset = 0;
+        if (in >> inode >> offset) {
+            saved_inode_ = inode;
+            saved_offset_ = offset;
+        }
+    }
+
+    void save_state() {
+        if (!state_path_.empty()) {
+            write_file_atomically(state_path_, std::to_string(inode_) + " " +
+                                                   std::to_string(offset_) +
+                                                   "\n");
+        }
+    }
+
+    void open_file() {
+        fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            return; // not there yet; the directory watch reports it
+        }
+
+        struct stat st;
+        ::fstat(fd_, &st);
+        inode_ = st.st_ino;
+        offset_ = 0;
+        if (inode_ == saved_inode_ &&
+            saved_offset_ <= static_cast<uint64_t>(st.st_size)) {
+            offset_ = saved_offset_;
+        }
+        saved_inode_ = 0;
+        ::lseek(fd_, static_cast<off_t>(offset_), SEEK_SET);
+
+        file_watch_ = inotify_add_watch(
+            inotify_, path_.c_str(),
+            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+
+    void close_file() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        if (file_watch_ >= 0) {
+            inotify_rm_watch(inotify_, file_watch_);
+            file_watch_ = -1;
+        }
+        pending_.clear();
+    }
+
+    // Keeps reading the old file until a new one appears under the path,
+    // so lines written just after a rename are not lost.
+    void reopen_if_replaced() {
+        struct stat st;
+        if (::stat(path_.c_str(), &st) != 0 ||
+            (fd_ >= 0 && st.st_ino == inode_)) {
+            return;
+        }
+        close_file();
+        open_file();
+        drain();
+    }
+
+    // Reads and converts everything available on the current file.
+    void drain() {
+        if (fd_ < 0) {
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(fd_, &st) == 0 &&
+            static_cast<uint64_t>(st.st_size) <
+                offset_ + pending_.size()) {
+            // Truncated in place: start over from the top.
+            ::lseek(fd_, 0, SEEK_SET);
+            offset_ = 0;
+            pending_.clear();
+        }
+
+        char block[1 << 16];
+        ssize_t got;
+        bool progressed = false;
+        RowErrors errors;
+        while ((got = ::read(fd_, block, sizeof(block))) > 0) {
+            pending_.append(block, static_cast<size_t>(got));
+            output_.clear();
+            size_t used = convert_complete_lines(converter_, pending_,
+                                                 output_, errors);
+            pending_.erase(0, used);
+            offset_ += used;
+            out_.write(output_.data(),
+                       static_cast<std::streamsize>(output_.size()));
+            progressed = progressed || used > 0;
+        }
+
+        if (progressed) {
+            out_.flush();
+            save_state();
+        }
+        errors.report(std::cerr, on_error_);
+        errors_.merge(errors);
+        errors_.check(max_errors_);
+    }
+
+    std::string path_;
+    std::string name_;
+    std::string state_path_;
+    LineConverter &converter_;
+    std::ostream &out_;
+
+    int inotify_{-1};
+    int dir_watch_{-1};
+    int file_watch_{-1};
+    int fd_{-1};
+    uint64_t inode_{0};
+    uint64_t offset_{0};
+    uint64_t saved_inode_{0};
+    uint64_t saved_offset_{0};
+    std::string pending_;
+    std::string output_;
+    RowErrors errors_;
+    OnError on_error_;
+    uint64_t max_errors_;
+};
+
+// Read-only memory map of a whole file. Empty files map to an empty view.
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(system_error_message("Cannot open " +
+                                                          path));
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error(system_error_message("Cannot stat " +
+                                                          path));
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void *map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error(system_error_message("Cannot map " +
+                                                              path));
+            }
+            data_ = static_cast<const char *>(map);
+            ::madvise(map, size_, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string_view data() const { return {data_, size_}; }
+
+  private:
+    const char *data_{nullptr};
+    size_t size_{0};
+};
+
+// Converts every line of `data` on `jobs` threads. Each worker converts a
+// newline-aligned slice into its own buffer; the buffers are joined in
+// input order, so output never depends on the thread count.
+// Bad rows are added to `errors`, which throws once the running total
+// passes the layout's limit.
+std::string convert_buffer(const std::string &from_unit,
+                           const std::string &to_unit,
+                           const RowLayout &layout, std::string_view data,
+                           unsigned jobs, RowErrors &errors) {
+    auto ranges = split_lines(data, jobs, layout.separator);
+    std::vector<std::string> outputs(ranges.size());
+    std::vector<RowErrors> worker_errors(ranges.size());
+    // With --max-errors, workers convert in blocks of a few thousand rows
+    // and add their bad rows to a shared count after each one, so every
+    // worker stops soon after the limit is passed instead of at the end of
+    // its range.
+    const bool limited =
+        layout.max_errors != std::numeric_limits<uint64_t>::max();
+    std::atomic<uint64_t> bad_rows{errors.total()};
+    // Workers build their own converters, but a bad plan, --split or
+    // template should fail here, on the calling thread, not in all of them.
+    LineConverter(from_unit, to_unit, layout);
+
+    run_workers(ranges.size(), [&](size_t w) {
+        // Allocated by the worker, so the pages land on its node.
+        auto [begin, end] = ranges[w];
+        outputs[w].reserve(end - begin);
+        auto converter =
+            std::make_unique<LineConverter>(from_unit, to_unit, layout);
+        if (!limited) {
+            converter->convert_rows(data.substr(begin, end - begin),
+                                    outputs[w], worker_errors[w]);
+            return;
+        }
+        constexpr size_t kBlockBytes = 64 << 10;
+        while (begin < end && bad_rows <= layout.max_errors) {
+            size_t stop = end;
+            if (end - begin > kBlockBytes) {
+                size_t cut = data.find(layout.separator,
+                                       begin + kBlockBytes - 1);
+                stop = cut == std::string_view::npos
+                           ? end
+                           : std::min(end, cut + 1);
+            }
+            uint64_t before = worker_errors[w].total();
+            converter->convert_rows(data.substr(begin, stop - begin),
+                                    outputs[w], worker_errors[w]);
+            bad_rows += worker_errors[w].total() - before;
+            begin = stop;
+        }
+    });
+
+    std::string out;
+    for (size_t w = 0; w < outputs.size(); ++w) {
+        if (out.empty()) {
+            out.swap(outputs[w]);
+        } else {
+            out += outputs[w];
+        }
+        errors.merge(worker_errors[w]);
+    }
+    errors.check(layout.max_errors);
+    return out;
+}
+
+// Converts `data` in row-aligned rounds of about `round` bytes (0 for one
+// round) and writes each round's output before starting the next, so
+// memory stays near two rounds however large the input is.
+void convert_in_rounds(const std::string &from_unit,
+                       const std::string &to_unit, const RowLayout &layout,
+                       std::string_view data, unsigned jobs, size_t round,
+                       std::FILE *out, RowErrors &errors) {
+    size_t begin = 0;
+    while (begin < data.size()) {
+        size_t end = data.size();
+        if (round > 0 && end - begin > round) {
+            size_t cut = data.find(layout.separator, begin + round - 1);
+            end = cut == std::string_view::npos ? data.size() : cut + 1;
+        }
+        std::string output =
+            convert_buffer(from_unit, to_unit, layout,
+                           data.substr(begin, end - begin), jobs, errors);
+        if (std::fwrite(output.data(), 1, output.size(), out) !=
+            output.size()) {
+            throw std::runtime_error("Write failed");
+        }
+        begin = end;
+    }
+}
+
+std::string to_hex(uint64_t value) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx",
+                  static_cast<unsigned long long>(value));
+    return buffer;
+}
+
+// Content-defined chunking with a gear rolling hash (as in FastCDC): a cut
+// falls wherever the low bits of the hash are zero, so an edit only moves
+// the boundaries next to it. Each cut is then pushed to the end of its line
+// so chunks always hold whole rows.
+std::vector<size_t> chunk_boundaries(std::string_view data) {
+    constexpr size_t kMinChunk = 256 << 10;
+    constexpr size_t kMaxChunk = 4 << 20;
+    // Test the high bits: they mix in the last 64 bytes, the low ones only
+    // the last 20, which is too little entropy for numeric text.
+    constexpr uint64_t kMask = ((uint64_t{1} << 20) - 1) << 44; // ~1 MiB
+
+    static const auto gear = [] {
+        std::array<uint64_t, 256> table{};
+        uint64_t state = 0x6a09e667f3bcc908ull; // splitmix64
+        for (auto &entry : table) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            entry = z ^ (z >> 31);
+        }
+        return table;
+    }();
+
+    std::vector<size_t> cuts;
+    size_t start = 0;
+    while (start < data.size()) {
+        size_t limit = std::min(data.size(), start + kMaxChunk);
+        size_t pos = std::min(limit, start + kMinChunk);
+        uint64_t hash = 0;
+        while (pos < limit) {
+            hash = (hash << 1) + gear[static_cast<unsigned char>(data[pos])];
+            ++pos;
+            if ((hash & kMask) == 0) {
+                break;
+            }
+        }
+
+        size_t newline = data.find('\n', pos == 0 ? 0 : pos - 1);
+        size_t cut =
+            newline == std::string_view::npos ? data.size() : newline + 1;
+        cuts.push_back(cut);
+        start = cut;
+    }
+    return cuts;
+}
+
+// Identifies a plan for caches and checkpoints: two runs with the same key
+// turn the same input bytes into the same output bytes.
+std::string plan_key(const std::string &from_unit, const std::string &to_unit,
+                     const RowLayout &layout) {
+    std::string key = "xcvt " + std::to_string(kPlanRevision) + "|" +
+                      from_unit + "|" + to_unit + "|" + layout.delimiter +
+                      "|" + std::to_string(layout.value_col) + "|" +
+                      std::to_string(layout.unit_col) + "|" +
+                      (layout.records ? "records" : "columns") +
+                      (layout.auto_scale ? "|auto" : "") + "|" +
+                      layout.split + "|" + layout.expression +
+                      (layout.on_error == OnError::Nan ? "|nan" : "") + "|" +
+                      std::to_string(static_cast<int>(layout.format));
+    return to_hex(hash_bytes(key, 0));
+}
+
+// On-disk map from (plan, chunk contents) to converted output. Entries are
+// files named by a 128-bit content hash under one directory per plan, and
+// are written through rename() so readers never see a partial entry. Each
+// entry starts with a line of the chunk's skipped-row counts, so a rerun
+// reports the same skips as the run that filled the cache, followed by the
+// output's length and hash; an entry that does not match them is treated
+// as missing and rewritten.
+class ChunkCache {
+  public:
+    ChunkCache(const std::string &root, const std::string &plan)
+        : dir_(root + "/" + plan) {
+        if ((::mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) ||
+            (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST)) {
+            throw std::runtime_error(
+                system_error_message("Cannot create cache " + dir_));
+        }
+    }
+
+    static std::string key_of(std::string_view chunk) {
+        return to_hex(hash_bytes(chunk, 1)) + to_hex(hash_bytes(chunk, 2));
+    }
+
+    bool lookup(const std::string &key, std::string &out,
+                RowErrors &errors) const {
+        std::ifstream in(dir_ + "/" + key, std::ios::binary);
+        std::string header;
+        if (!std::getline(in, header)) {
+            return false;
+        }
+        std::istringstream fields(header);
+        RowErrors skipped;
+        for (uint64_t &count : skipped.counts) {
+            fields >> count;
+        }
+        size_t size = 0;
+        std::string hash;
+        if (!(fields >> size >> hash)) {
+            return false;
+        }
+        out.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+        if (in.bad() || out.size() != size ||
+            to_hex(hash_bytes(out, 3)) != hash) {
+            return false;
+        }
+        errors.merge(skipped);
+        return true;
+    }
+
+    void store(const std::string &key, const std::string &output,
+               const RowErrors &errors) const {
+        std::string entry;
+        for (uint64_t count : errors.counts) {
+            entry += std::to_string(count) + ' ';
+        }
+        entry += std::to_string(output.size()) + ' ' +
+                 to_hex(hash_bytes(output, 3)) + '\n';
+        entry += output;
+        write_file_atomically(dir_ + "/" + key, entry);
+    }
+
+  private:
+    std::string dir_;
+};
+
+// Converts `data` chunk by chunk, copying the output of any chunk whose
+// contents were converted by an earlier run with the same plan. Only new
+// or edited chunks are parsed, so reruns cost roughly the size of the
+// change.
+void convert_with_cache(const std::string &from_unit,
+                        const std::string &to_unit, const RowLayout &layout,
+                        std::string_view data, const std::string &cache_dir,
+                        unsigned jobs, std::FILE *out, RowErrors &errors) {
+    ChunkCache cache(cache_dir, plan_key(from_unit, to_unit, layout));
+
+    uint64_t hits = 0, misses = 0;
+    size_t start = 0;
+    std::string output;
+    for (size_t cut : chunk_boundaries(data)) {
+        std::string_view chunk = data.substr(start, cut - start);
+        std::string key = ChunkCache::key_of(chunk);
+        if (cache.lookup(key, output, errors)) {
+            ++hits;
+        } else {
+            ++misses;
+            RowErrors chunk_errors;
+            output = convert_buffer(from_unit, to_unit, layout, chunk, jobs,
+                                    chunk_errors);
+            cache.store(key, output, chunk_errors);
+            errors.merge(chunk_errors);
+        }
+        errors.check(layout.max_errors);
+        if (std::fwrite(output.data(), 1, output.size(), out) !=
+            output.size()) {
+            throw std::runtime_error("Write failed");
+        }
+        start = cut;
+    }
+
+    std::cerr << "Cache: " << hits << " chunk(s) reused, " << misses
+              << " converted\n";
+}
+
+void write_all(int fd, std::string_view data, const std::string &path) {
+    while (!data.empty()) {
+        ssize_t wrote = ::write(fd, data.data(), data.size());
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(system_error_message("Cannot write " +
+                                                          path));
+        }
+        data.remove_prefix(static_cast<size_t>(wrote));
+    }
+}
+
+// Progress of a batch conversion, saved next to the output so a killed job
+// can pick up where it left off. The input is identified by inode, size
+// and mtime, and the plan by its hash; a checkpoint for anything else is
+// refused rather than silently producing mixed output.
+struct Checkpoint {
+    std::string plan;
+    uint64_t input_inode{0};
+    uint64_t input_size{0};
+    int64_t input_mtime_ns{0};
+    uint64_t input_offset{0};
+    uint64_t output_offset{0};
+    RowErrors errors; // counts only; rejects don't mix with checkpoints
+
+    std::string serialize() const {
+        std::string text = "xcvt-checkpoint 2\n"
+                           "plan " +
+                           plan + "\ninput " + std::to_string(input_inode) +
+                           " " + std::to_string(input_size) + " " +
+                           std::to_string(input_mtime_ns) + "\noffsets " +
+                           std::to_string(input_offset) + " " +
+                           std::to_string(output_offset) + "\nskipped";
+        for (uint64_t count : errors.counts) {
+            text += " " + std::to_string(count);
+        }
+        return text + "\n";
+    }
+
+    static Checkpoint load(const std::string &path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("No checkpoint at " + path);
+        }
+        Checkpoint ckpt;
+        std::string magic, version, tag;
+        in >> magic >> version >> tag >> ckpt.plan >> tag >>
+            ckpt.input_inode >> ckpt.input_size >> ckpt.input_mtime_ns >>
+            tag >> ckpt.input_offset >> ckpt.output_offset >> tag;
+        // Version 1 kept a single total, before reasons were counted.
+        size_t counts = version == "1" ? 1 : kConvertErrors;
+        for (size_t i = 0; i < counts; ++i) {
+            in >> ckpt.errors.counts[i];
+        }
+        if (!in || magic != "xcvt-checkpoint" ||
+            (version != "1" && version != "2")) {
+            throw std::runtime_error(path + " is not a valid checkpoint");
+        }
+        return ckpt;
+    }
+};
+
+// Converts `input_path` into `output_path` in newline-aligned segments,
+// checkpointing to `checkpoint_path` at most every `interval` seconds. A
+// checkpoint is only written after the output it covers has been synced,
+// so on resume the output is cut back to that point and nothing is lost
+// or duplicated.
+void convert_with_checkpoints(const std::string &from_unit,
+                              const std::string &to_unit,
+                              const RowLayout &layout,
+                              const std::string &input_path,
+                              const std::string &output_path,
+                              const std::string &checkpoint_path,
+                              double interval, bool resume, unsigned jobs,
+                              RowErrors &errors) {
+    constexpr size_t kSegment = 64 << 20;
+
+    MappedFile input(input_path);
+    std::string_view data = input.data();
+    struct stat st;
+    if (::stat(input_path.c_str(), &st) != 0) {
+        throw std::runtime_error(system_error_message("Cannot stat " +
+                                                      input_path));
+    }
+
+    Checkpoint ckpt;
+    ckpt.plan = plan_key(from_unit, to_unit, layout);
+    ckpt.input_inode = st.st_ino;
+    ckpt.input_size = static_cast<uint64_t>(st.st_size);
+    ckpt.input_mtime_ns =
+        static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+        st.st_mtim.tv_nsec;
+
+    // Restart scripts can always pass --resume: with no checkpoint left
+    // behind there is nothing to continue, so the job starts over.
+    if (resume && ::access(checkpoint_path.c_str(), F_OK) != 0) {
+        std::cerr << "No checkpoint at " << checkpoint_path
+                  << ", starting from the beginning\n";
+        resume = false;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+    int fd = ::open(output_path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw std::runtime_error(system_error_message("Cannot write " +
+                                                      output_path));
+    }
+
+    try {
+        if (resume) {
+            Checkpoint saved = Checkpoint::load(checkpoint_path);
+            if (saved.plan != ckpt.plan) {
+                throw std::runtime_error(
+                    "Checkpoint was written with different units or columns");
+            }
+            if (saved.input_inode != ckpt.input_inode ||
+                saved.input_size != ckpt.input_size ||
+                saved.input_mtime_ns != ckpt.input_mtime_ns ||
+                saved.input_offset > ckpt.input_size) {
+                throw std::runtime_error("Input changed since the checkpoint");
+            }
+            struct stat out_st;
+            ::fstat(fd, &out_st);
+            if (static_cast<uint64_t>(out_st.st_size) < saved.output_offset) {
+                throw std::runtime_error(
+                    "Output is shorter than the checkpoint");
+            }
+            if (::ftruncate(fd, static_cast<off_t>(saved.output_offset)) !=
+                0) {
+                throw std::runtime_error(system_error_message(
+                    "Cannot truncate " + output_path));
+            }
+            ckpt.input_offset = saved.input_offset;
+            ckpt.output_offset = saved.output_offset;
+            ckpt.errors = saved.errors;
+        }
+        ::lseek(fd, static_cast<off_t>(ckpt.output_offset), SEEK_SET);
+
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        while (ckpt.input_offset < data.size()) {
+            size_t end = std::min(data.size(), ckpt.input_offset + kSegment);
+            if (end < data.size()) {
+                size_t newline = data.find('\n', end - 1);
+                end = newline == std::string_view::npos ? data.size()
+                                                        : newline + 1;
+            }
+
+            std::string output = convert_buffer(
+                from_unit, to_unit, layout,
+                data.substr(ckpt.input_offset, end - ckpt.input_offset),
+                jobs, ckpt.errors);
+            write_all(fd, output, output_path);
+            ckpt.input_offset = end;
+            ckpt.output_offset += output.size();
+
+            auto now = std::chrono::steady_clock::now();
+            if (std::chrono::duration<double>(now - last_checkpoint)
+                        .count() >= interval &&
+                ckpt.input_offset < data.size()) {
+                if (::fdatasync(fd) != 0) {
+                    throw std::runtime_error(system_error_message(
+                        "Cannot sync " + output_path));
+                }
+                write_file_atomically(checkpoint_path, ckpt.serialize());
+                last_checkpoint = now;
+            }
+        }
+
+        if (::fsync(fd) != 0) {
+            throw std::runtime_error(system_error_message("Cannot sync " +
+                                                          output_path));
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+
+    // Finished: the checkpoint is no longer needed.
+    std::remove(checkpoint_path.c_str());
+    errors.merge(ckpt.errors);
+}
+
+// Loads the offsets of a FILE.idx sidecar: known line starts written by
+// --write-index. Returns an empty list when there is no sidecar or it was
+// built for a different version of the file.
+std::vector<uint64_t> load_line_index(const std::string &path,
+                                      uint64_t file_size) {
+    std::vector<uint64_t> offsets;
+    std::ifstream in(path + ".idx");
+    std::string magic, version;
+    uint64_t size = 0;
+    if (!(in >> magic >> version >> size) || magic != "xcvt-index" ||
+        version != "1" || size != file_size) {
+        return offsets;
+    }
+    uint64_t offset;
+    while (in >> offset) {
+        offsets.push_back(offset);
+    }
+    return offsets;
+}
+
+// Writes FILE.idx with the start offset of every `stride`-th line.
+void write_line_index(const std::string &path, size_t stride) {
+    MappedFile input(path);
+    std::string_view data = input.data();
+    std::string index = "xcvt-index 1 " + std::to_string(data.size()) + "\n";
+
+    size_t lines = 0;
+    for (size_t pos = 0; pos < data.size();) {
+        if (lines++ % stride == 0) {
+            index += std::to_string(pos);
+            index += '\n';
+        }
+        size_t newline = data.find('\n', pos);
+        pos = newline == std::string_view::npos ? data.size() : newline + 1;
+    }
+    write_file_atomically(path + ".idx", index);
+}
+
+// Moves byte `target` forward to the next line start, using the sidecar
+// index when there is one so no data has to be scanned.
+size_t align_to_line(std::string_view data, size_t target,
+                     const std::vector<uint64_t> &index) {
+    if (target == 0 || target >= data.size()) {
+        return std::min(target, data.size());
+    }
+    if (!index.empty()) {
+        auto it = std::lower_bound(index.begin(), index.end(), target);
+        return it == index.end() ? data.size() : static_cast<size_t>(*it);
+    }
+    size_t newline = data.find('\n', target - 1);
+    return newline == std::string_view::npos ? data.size() : newline + 1;
+}
+
+// Shard i owns the lines that start in [i * size / N, (i + 1) * size / N).
+// Every shard computes its boundaries the same way, so the N ranges tile
+// the file exactly and concatenating shard outputs in order reproduces a
+// single-process run.
+std::string_view shard_of(std::string_view data, const ShardSpec &shard,
+                          const std::vector<uint64_t> &index) {
+    size_t begin = align_to_line(
+        data, data.size() / shard.count * shard.index +
+                  data.size() % shard.count * shard.index / shard.count,
+        index);
+    size_t end = data.size();
+    if (shard.index + 1 < shard.count) {
+        size_t next = shard.index + 1;
+        end = align_to_line(
+            data, data.size() / shard.count * next +
+                      data.size() % shard.count * next / shard.count,
+            index);
+    }
+    return data.substr(begin, end - begin);
+}
+
+// The bytes one run processes: the mapped -i file, or all of stdin,
+// narrowed to this process's shard.
+class InputData {
+  public:
+    InputData(const std::string &path, const ShardSpec &shard) {
+        std::vector<uint64_t> index;
+        if (!path.empty()) {
+            mapped_.emplace(path);
+            data_ = mapped_->data();
+            if (shard.count > 1) {
+                index = load_line_index(path, data_.size());
+            }
+        } else {
+            piped_ = read_all(stdin);
+            data_ = piped_;
+        }
+        data_ = shard_of(data_, shard, index);
+    }
+
+    std::string_view data() const { return data_; }
+
+  private:
+    std::optional<MappedFile> mapped_;
+    std::string piped_;
+    std::string_view data_;
+};
+
+// Opens -o for writing, or returns stdout when no path was given.
+std::FILE *open_output(const std::string &path, FileHandle &holder) {
+    if (path.empty()) {
+        return stdout;
+    }
+    holder.reset(std::fopen(path.c_str(), "wb"));
+    if (!holder) {
+        throw std::runtime_error(system_error_message("Cannot write " + path));
+    }
+    return holder.get();
+}
+
+// --merge concat: appends shard outputs in the order given.
+void merge_concat(const std::vector<std::string> &paths, std::FILE *out) {
+    for (const auto &path : paths) {
+        MappedFile part(path);
+        std::string_view data = part.data();
+        if (std::fwrite(data.data(), 1, data.size(), out) != data.size()) {
+            throw std::runtime_error("Write failed");
+        }
+    }
+}
+
+// --merge groups: re-aggregates --group-by outputs from several shards.
+void merge_groups(const std::vector<std::string> &paths, std::ostream &out) {
+    GroupTable merged;
+    for (const auto &path : paths) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Cannot read " + path);
+        }
+
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            std::istringstream fields(line.substr(tab + 1));
+            GroupAggregate aggregate;
+            double mean;
+            std::string min, max;
+            if (!(fields >> aggregate.count >> aggregate.sum >> mean >> min >>
+                  max)) {
+                throw std::runtime_error("Malformed group row in " + path);
+            }
+            aggregate.min = std::stod(min);
+            aggregate.max = std::stod(max);
+
+            std::string_view key(line.data(), tab);
+            merged.find_or_insert(key, hash_key(key)).merge(aggregate);
+        }
+    }
+    print_groups(merged, out);
+}
+
+// Coordinator-free work queue over a shared spool directory. The input is
+// cut into fixed, newline-aligned chunks that every worker derives the same
+// way. A worker claims chunk i by creating `lease.i` with O_EXCL, keeps
+// the lease's mtime fresh from a heartbeat thread while it converts, and
+// publishes `out.i` with rename(). A lease whose mtime is older than the
+// lease time belongs to a dead worker: it is renamed away (only one
+// contender can win that rename), checked again in case a live worker
+// re-leased it in between, and claimed again. Chunk output is a pure
+// function of the chunk, so a slow worker finishing a reclaimed chunk just
+// renames identical bytes over the same name; each worker writes its own
+// temp file, so the two never mix.
+class SpoolWorker {
+  public:
+    SpoolWorker(std::string dir, double lease_seconds)
+        : dir_(std::move(dir)), lease_seconds_(lease_seconds) {
+        char host[256] = {};
+        ::gethostname(host, sizeof(host) - 1);
+        owner_ = std::string(host) + ":" + std::to_string(::getpid());
+    }
+
+    void run(const std::string &from_unit, const std::string &to_unit,
+             const RowLayout &layout, const std::string &input_path,
+             size_t chunk_size, unsigned jobs) {
+        MappedFile input(input_path);
+        std::string_view data = input.data();
+        size_t chunks = std::max<size_t>(
+            1, (data.size() + chunk_size - 1) / chunk_size);
+        join_job(plan_key(from_unit, to_unit, layout), data.size(), chunks,
+                 chunk_size);
+
+        std::vector<uint64_t> no_index;
+        size_t start = hash_key(owner_) % chunks; // spread first claims
+        size_t converted = 0;
+        RowErrors errors; // this worker's chunks only
+        while (true) {
+            size_t remaining = 0;
+            for (size_t n = 0; n < chunks; ++n) {
+                size_t i = (start + n) % chunks;
+                if (exists(path_of("out", i))) {
+                    continue;
+                }
+                ++remaining;
+                if (!claim(i)) {
+                    continue;
+                }
+
+                size_t begin =
+                    align_to_line(data, i * chunk_size, no_index);
+                size_t end =
+                    align_to_line(data, (i + 1) * chunk_size, no_index);
+                std::string output;
+                {
+                    Heartbeat heartbeat(path_of("lease", i),
+                                        lease_seconds_ / 3);
+                    output = convert_buffer(from_unit, to_unit, layout,
+                                            data.substr(begin, end - begin),
+                                            jobs, errors);
+                }
+                publish(i, output);
+                release(i);
+                ++converted;
+                --remaining;
+            }
+
+            if (remaining == 0) {
+                break;
+            }
+            // Everything left is leased by someone else; wait for them to
+            // finish or for a lease to expire.
+            std::this_thread::sleep_for(std::chrono::duration<double>(
+                std::min(1.0, lease_seconds_ / 4)));
+        }
+
+        std::cerr << owner_ << " converted " << converted << " of "
+                  << chunks << " chunk(s)\n";
+        errors.report(std::cerr, layout.on_error);
+    }
+
+  private:
+    // Touches the lease file every `period` seconds until destroyed.
+    class Heartbeat {
+      public:
+        Heartbeat(std::string path, double period)
+            : path_(std::move(path)), thread_([this, period] {
+                  std::unique_lock<std::mutex> lock(mutex_);
+                  while (!done_) {
+                      if (cv_.wait_for(lock,
+                                       std::chrono::duration<double>(period),
+                                       [this] { return done_; })) {
+                          break;
+                      }
+                      ::utimensat(AT_FDCWD, path_.c_str(), nullptr, 0);
+                  }
+              }) {}
+
+        ~Heartbeat() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+
+      private:
+        std::string path_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool done_{false};
+        std::thread thread_;
+    };
+
+    std::string path_of(const char *kind, size_t chunk) const {
+        return dir_ + "/" + kind + "." + std::to_string(chunk);
+    }
+
+    static bool exists(const std::string &path) {
+        return ::access(path.c_str(), F_OK) == 0;
+    }
+
+    // The first worker publishes the job description with link(), which
+    // fails if another worker got there first; everyone then checks that
+    // they are working on the same job.
+    void join_job(const std::string &plan, size_t size, size_t chunks,
+                  size_t chunk_size) {
+        if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error(
+                system_error_message("Cannot create spool " + dir_));
+        }
+
+        std::string job = "xcvt-spool 1\nplan " + plan + "\ninput " +
+                          std::to_string(size) + "\nchunks " +
+                          std::to_string(chunks) + " " +
+                          std::to_string(chunk_size) + "\n";
+        std::string job_path = dir_ + "/job";
+        std::string temp = job_path + "." + owner_;
+        write_file_atomically(temp, job);
+        ::link(temp.c_str(), job_path.c_str());
+        ::unlink(temp.c_str());
+
+        std::ifstream in(job_path);
+        std::string existing((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+        if (existing != job) {
+            throw std::runtime_error(
+                "Spool " + dir_ +
+                " holds a different job (input, units or chunk size)");
+        }
+    }
+
+    bool claim(size_t chunk) {
+        std::string lease = path_of("lease", chunk);
+        if (try_create(lease)) {
+            return true;
+        }
+
+        struct stat st;
+        if (::stat(lease.c_str(), &st) != 0) {
+            return try_create(lease); // released in the meantime
+        }
+        double age = static_cast<double>(std::time(nullptr) - st.st_mtime);
+        if (age < lease_seconds_) {
+            return false;
+        }
+
+        std::string stale = lease + ".stale." + owner_;
+        if (std::rename(lease.c_str(), stale.c_str()) != 0) {
+            return false; // another worker reclaimed it first
+        }
+        // Between the stat and the rename another worker may have reclaimed
+        // the chunk itself, in which case we just took its fresh lease. Put
+        // it back (link fails if the name has been taken again since).
+        if (::stat(stale.c_str(), &st) == 0 &&
+            static_cast<double>(std::time(nullptr) - st.st_mtime) <
+                lease_seconds_) {
+            ::link(stale.c_str(), lease.c_str());
+            ::unlink(stale.c_str());
+            return false;
+        }
+        ::unlink(stale.c_str());
+        return try_create(lease);
+    }
+
+    // Writes the output of `chunk`. Losing a race to a worker that
+    // published the same chunk is fine: its bytes are the same.
+    void publish(size_t chunk, const std::string &output) const {
+        std::string path = path_of("out", chunk);
+        try {
+            write_file_atomically(path, output);
+        } catch (const std::runtime_error &) {
+            if (!exists(path)) {
+                throw;
+            }
+        }
+    }
+
+    // Drops our lease on `chunk`, unless it expired and now belongs to
+    // another worker.
+    void release(size_t chunk) const {
+        std::string lease = path_of("lease", chunk);
+        std::ifstream in(lease);
+        std::string who;
+        if (std::getline(in, who) && who == owner_) {
+            ::unlink(lease.c_str());
+        }
+    }
+
+    bool try_create(const std::string &lease) const {
+        int fd = ::open(lease.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        std::string who = owner_ + "\n";
+        ::write(fd, who.data(), who.size());
+        ::close(fd);
+        return true;
+    }
+
+    std::string dir_;
+    double lease_seconds_;
+    std::string owner_;
+};
+
+// --merge spool DIR: stitches a finished spool's chunk outputs together.
+void merge_spool(const std::string &dir, std::FILE *out) {
+    std::ifstream job(dir + "/job");
+    std::string line;
+    size_t chunks = 0;
+    while (std::getline(job, line)) {
+        if (line.rfind("chunks ", 0) == 0) {
+            chunks = std::stoul(line.substr(7));
+        }
+    }
+    if (chunks == 0) {
+        throw std::runtime_error(dir + " is not an xcvt spool");
+    }
+
+    std::vector<std::string> parts;
+    for (size_t i = 0; i < chunks; ++i) {
+        parts.push_back(dir + "/out." + std::to_string(i));
+        if (::access(parts.back().c_str(), F_OK) != 0) {
+            throw std::runtime_error("Spool is incomplete: chunk " +
+                                     std::to_string(i) + " is missing");
+        }
+    }
+    merge_concat(parts, out);
+}
+
+// Counting semaphore that caps how many files the tree workers hold open,
+// derived from RLIMIT_NOFILE.
+class FileSlots {
+  public:
+    FileSlots() {
+        struct rlimit limit;
+        size_t slots = 64;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur != RLIM_INFINITY) {
+            // Leave headroom for stdio, inotify and friends.
+            slots = limit.rlim_cur > 32 ? (limit.rlim_cur - 16) / 2 : 1;
+        }
+        free_ = slots;
+    }
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return free_ > 0; });
+        --free_;
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++free_;
+        }
+        cv_.notify_one();
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t free_{0};
+};
+
+// One unit of tree work: a batch of small files, or one chunk of a large
+// file (`files.size() == 1` and `chunk` picks the slice).
+struct TreeTask {
+    std::vector<size_t> files;
+    size_t chunk{0};
+};
+
+// Per-worker task deque. The owner pops from the front; idle workers steal
+// from the back, where the owner is least likely to be looking.
+class TaskDeque {
+  public:
+    void push(TreeTask task) { tasks_.push_back(std::move(task)); }
+
+    bool pop(TreeTask &task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+            return false;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+        return true;
+    }
+
+    bool steal(TreeTask &task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+            return false;
+        }
+        task = std::move(tasks_.back());
+        tasks_.pop_back();
+        return true;
+    }
+
+    // First file of the next task, for readahead.
+    bool peek_file(size_t &file) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+            return false;
+        }
+        file = tasks_.front().files.front();
+        return true;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::deque<TreeTask> tasks_;
+};
+
+// `xcvt --recursive DIR -o OUTDIR`: converts every regular file under DIR
+// into the same relative path under OUTDIR. Large files are cut into
+// newline-aligned chunks and small files are batched, so every task is
+// roughly the same amount of work. Tasks are dealt largest first across
+// per-worker deques, idle workers steal, and each worker asks the kernel to
+// read ahead the next file in its queue while it converts the current one.
+class TreeConverter {
+  public:
+    static constexpr uint64_t kChunkBytes = 8 << 20;
+    static constexpr uint64_t kBatchBytes = 1 << 20;
+
+    TreeConverter(const std::string &from_unit, const std::string &to_unit,
+                  const RowLayout &layout)
+        : from_unit_(from_unit), to_unit_(to_unit), layout_(layout),
+          max_errors_(layout.max_errors) {
+        // Bad rows are limited across the whole tree, not per chunk.
+        layout_.max_errors = std::numeric_limits<uint64_t>::max();
+        // A bad plan, --split or template fails here, once, rather than
+        // once per file.
+        LineConverter(from_unit_, to_unit_, layout_);
+    }
+
+    // Bad rows of every file, by reason (and the rows, for a reject file).
+    const RowErrors &row_errors() const { return rows_; }
+
+    // Returns the number of files that could not be converted.
+    size_t run(const std::string &in_dir, const std::string &out_dir,
+               unsigned jobs) {
+        namespace fs = std::filesystem;
+        in_dir_ = in_dir;
+        out_dir_ = out_dir;
+        for (const auto &entry : fs::recursive_directory_iterator(in_dir)) {
+            if (entry.is_regular_file()) {
+                files_.push_back(
+                    {fs::relative(entry.path(), in_dir).string(),
+                     static_cast<uint64_t>(entry.file_size())});
+            }
+        }
+        std::sort(files_.begin(), files_.end(),
+                  [](const TreeFile &a, const TreeFile &b) {
+                      return a.size > b.size;
+                  });
+
+        remaining_ = std::vector<std::atomic<size_t>>(files_.size());
+        failed_ = std::vector<std::atomic<bool>>(files_.size());
+        parts_.resize(files_.size());
+        queues_ = std::vector<TaskDeque>(jobs);
+        size_t next_queue = 0;
+        auto deal = [&](TreeTask task) {
+            queues_[next_queue++ % jobs].push(std::move(task));
+        };
+
+        TreeTask batch;
+        uint64_t batch_bytes = 0;
+        for (size_t f = 0; f < files_.size(); ++f) {
+            size_t chunks = static_cast<size_t>(
+                std::max<uint64_t>(1, (files_[f].size + kChunkBytes - 1) /
+                                          kChunkBytes));
+            remaining_[f] = chunks;
+            parts_[f].resize(chunks);
+            if (files_[f].size >= kBatchBytes) {
+                for (size_t c = 0; c < chunks; ++c) {
+                    deal(TreeTask{{f}, c});
+                }
+                continue;
+            }
+            batch.files.push_back(f);
+            batch_bytes += files_[f].size;
+            if (batch_bytes >= kBatchBytes) {
+                deal(std::move(batch));
+                batch = TreeTask{};
+                batch_bytes = 0;
+            }
+        }
+        if (!batch.files.empty()) {
+            deal(std::move(batch));
+        }
+
+        run_workers(jobs, [&](size_t w) { work(w); });
+
+        rows_.report(std::cerr, layout_.on_error);
+        rows_.check(max_errors_);
+        for (const auto &error : errors_) {
+            std::cerr << error << "\n";
+        }
+        size_t failed = static_cast<size_t>(
+            std::count(failed_.begin(), failed_.end(), true));
+        std::cerr << "Converted " << files_.size() - failed << " of "
+                  << files_.size() << " file(s)\n";
+        return failed;
+    }
+
+  private:
+    struct TreeFile {
+        std::string relative;
+        uint64_t size;
+    };
+
+    void work(size_t self) {
+        TreeTask task;
+        while (next_task(self, task)) {
+            size_t next;
+            if (queues_[self].peek_file(next)) {
+                prefetch(next);
+            }
+            for (size_t f : task.files) {
+                // Once a file has failed, its other chunks are wasted work.
+                if (failed_[f] || gave_up_) {
+                    continue;
+                }
+                try {
+                    convert_part(f, task.chunk);
+                } catch (const std::exception &e) {
+                    if (!failed_[f].exchange(true)) {
+                        std::lock_guard<std::mutex> lock(errors_mutex_);
+                        errors_.push_back(files_[f].relative + ": " +
+                                          e.what());
+                    }
+                }
+            }
+        }
+    }
+
+    bool next_task(size_t self, TreeTask &task) {
+        if (queues_[self].pop(task)) {
+            return true;
+        }
+        // No new tasks appear once work starts, so one failed sweep over
+        // every victim means the queues are drained.
+        for (size_t n = 1; n < queues_.size(); ++n) {
+            if (queues_[(self + n) % queues_.size()].steal(task)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string input_path(size_t f) const {
+        return in_dir_ + "/" + files_[f].relative;
+    }
+
+    void prefetch(size_t f) {
+        slots_.acquire();
+        int fd = ::open(input_path(f).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::readahead(fd, 0,
+                        static_cast<size_t>(std::min<uint64_t>(
+                            files_[f].size, kChunkBytes)));
+            ::close(fd);
+        }
+        slots_.release();
+    }
+
+    // Converts one chunk of file `f`; whoever finishes the file's last
+    // chunk writes the joined output.
+    void convert_part(size_t f, size_t chunk) {
+        slots_.acquire();
+        std::optional<MappedFile> input;
+        try {
+            input.emplace(input_path(f));
+        } catch (...) {
+            slots_.release();
+            throw;
+        }
+        slots_.release();
+
+        std::string_view data = input->data();
+        std::vector<uint64_t> no_index;
+        size_t begin = align_to_line(data, chunk * kChunkBytes, no_index);
+        size_t end = align_to_line(data, (chunk + 1) * kChunkBytes, no_index);
+        RowErrors errors;
+        parts_[f][chunk] =
+            convert_buffer(from_unit_, to_unit_, layout_,
+                           data.substr(begin, end - begin), 1, errors);
+        if (errors.total() > 0) {
+            std::lock_guard<std::mutex> lock(errors_mutex_);
+            rows_.merge(errors);
+            if (rows_.total() > max_errors_) {
+                gave_up_ = true;
+            }
+        }
+
+        if (--remaining_[f] > 0 || failed_[f] || gave_up_) {
+            return;
+        }
+
+        std::string output;
+        for (auto &part : parts_[f]) {
+            output += part;
+            std::string().swap(part);
+        }
+        std::filesystem::path out_path =
+            std::filesystem::path(out_dir_) / files_[f].relative;
+        std::filesystem::create_directories(out_path.parent_path());
+        slots_.acquire();
+        try {
+            // Temp names are unique per call, so inputs `x` and `x.tmp`
+            // never write through the same file.
+            write_file_atomically(out_path.string(), output);
+        } catch (...) {
+            slots_.release();
+            throw;
+        }
+        slots_.release();
+    }
+
+    std::string from_unit_;
+    std::string to_unit_;
+    RowLayout layout_;
+    std::string in_dir_;
+    std::string out_dir_;
+
+    std::vector<TreeFile> files_;
+    std::vector<std::atomic<size_t>> remaining_;
+    std::vector<std::atomic<bool>> failed_;
+    std::vector<std::vector<std::string>> parts_;
+    std::vector<TaskDeque> queues_;
+    FileSlots slots_;
+
+    uint64_t max_errors_;
+    std::atomic<bool> gave_up_{false};
+
+    std::mutex errors_mutex_; // guards errors_ and rows_
+    std::vector<std::string> errors_;
+    RowErrors rows_;
+};
+
+// A telemetry channel and the plan its readings go through.
+struct ChannelPlan {
+    std::string name;
+    ConversionPlan plan;
+};
+
+// Parses --channel NAME=FROM:TO.
+ChannelPlan parse_channel(const std::string &spec) {
+    size_t eq = spec.find('=');
+    size_t colon = spec.find(':', eq == std::string::npos ? 0 : eq);
+    if (eq == std::string::npos || colon == std::string::npos || eq == 0) {
+        throw std::invalid_argument("'--channel' expects NAME=FROM:TO.");
+    }
+    return {spec.substr(0, eq),
+            make_plan(normalize_unit(spec.substr(eq + 1, colon - eq - 1)),
+                      normalize_unit(spec.substr(colon + 1)))};
+}
+
+// `--listen-udp PORT`: converts telemetry datagrams as they arrive. Each
+// datagram holds lines of `CHANNEL VALUE` (space, tab or comma separated);
+// every reading goes through its channel's prebuilt plan (or the -f/-t
+// plan for channels not listed) and comes out as `CHANNEL VALUE` again.
+// Datagrams are received and forwarded in batches with recvmmsg/sendmmsg,
+// into buffers allocated once per socket, so the per-packet path never
+// allocates. With several sockets, SO_REUSEPORT lets the kernel spread
+// senders across them and each socket gets its own thread.
+class UdpConverter {
+  public:
+    static constexpr size_t kBatch = 64;
+    static constexpr size_t kDatagram = 2048;
+
+    UdpConverter(std::vector<ChannelPlan> channels,
+                 std::optional<ConversionPlan> fallback)
+        : channels_(std::move(channels)), fallback_(std::move(fallback)) {}
+
+    [[noreturn]] void run(uint16_t port, unsigned sockets,
+                          const std::string &forward, std::FILE *out) {
+        sockaddr_in target{};
+        if (!forward.empty()) {
+            target = resolve(forward);
+        }
+
+        std::vector<int> fds;
+        for (unsigned i = 0; i < sockets; ++i) {
+            fds.push_back(open_socket(port, sockets > 1));
+        }
+
+        run_workers(fds.size(), [&](size_t w) {
+            serve(fds[w], forward.empty() ? nullptr : &target, out);
+        });
+        throw std::runtime_error("UDP workers stopped");
+    }
+
+  private:
+    static sockaddr_in resolve(const std::string &host_port) {
+        size_t colon = host_port.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("'--forward' expects HOST:PORT.");
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *found = nullptr;
+        std::string host = host_port.substr(0, colon);
+        std::string port = host_port.substr(colon + 1);
+        if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 ||
+            found == nullptr) {
+            throw std::runtime_error("Cannot resolve " + host_port);
+        }
+        sockaddr_in addr;
+        std::memcpy(&addr, found->ai_addr, sizeof(addr));
+        ::freeaddrinfo(found);
+        return addr;
+    }
+
+    static int open_socket(uint16_t port, bool reuse_port) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error(system_error_message("socket"));
+        }
+        int one = 1;
+        if (reuse_port) {
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        }
+        int buffer = 8 << 20;
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+            0) {
+            throw std::runtime_error(system_error_message(
+                "Cannot bind UDP port " + std::to_string(port)));
+        }
+        return fd;
+    }
+
+    const ConversionPlan *plan_for(std::string_view channel) const {
+        for (const auto &entry : channels_) {
+            if (entry.name == channel) {
+                return &entry.plan;
+            }
+        }
+        return fallback_ ? &*fallback_ : nullptr;
+    }
+
+    // Converts the readings in one datagram into [out, limit), returning
+    // the end of what was written. Readings that do not parse, or do not
+    // fit (counted in no_room_), are dropped.
+    char *convert_datagram(std::string_view datagram, char *out,
+                           char *limit) {
+        for_each_line(datagram, [&](std::string_view line) {
+            size_t split = line.find_first_of(" \t,");
+            if (split == std::string_view::npos) {
+                return;
+            }
+            std::string_view channel = line.substr(0, split);
+            std::string_view text = line.substr(split + 1);
+            const ConversionPlan *plan = plan_for(channel);
+            double value;
+            if (plan == nullptr ||
+                !parse_number(text.data(), text.data() + text.size(),
+                              value)) {
+                return;
+            }
+            if (limit - out < static_cast<ptrdiff_t>(channel.size()) + 34) {
+                ++no_room_;
+                return;
+            }
+            out = std::copy(channel.begin(), channel.end(), out);
+            *out++ = ' ';
+            out = std::to_chars(out, limit, plan->apply(value),
+                                std::chars_format::general, 6)
+                      .ptr;
+            *out++ = '\n';
+        });
+        return out;
+    }
+
+    // Prints the drop totals to stderr when they have grown, at most once
+    // a second across all sockets.
+    void report_drops() {
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                          std::chrono::steady_clock::now().time_since_epoch())
+                          .count();
+        int64_t last = last_report_;
+        if (now <= last || !last_report_.compare_exchange_strong(last, now)) {
+            return;
+        }
+        std::cerr << "Dropped " << truncated_ << " truncated datagram(s), "
+                  << no_room_ << " reading(s) with no output room\n";
+    }
+
+    void serve(int fd, const sockaddr_in *target, std::FILE *out) {
+        std::vector<char> in_buffer(kBatch * kDatagram);
+        std::vector<char> out_buffer(kBatch * kDatagram * 2);
+        std::array<iovec, kBatch> in_iov{}, out_iov{};
+        std::array<mmsghdr, kBatch> in_msgs{}, out_msgs{};
+        for (size_t i = 0; i < kBatch; ++i) {
+            in_iov[i] = {in_buffer.data() + i * kDatagram, kDatagram};
+            in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+            in_msgs[i].msg_hdr.msg_iovlen = 1;
+            out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+            out_msgs[i].msg_hdr.msg_iovlen = 1;
+            if (target != nullptr) {
+                out_msgs[i].msg_hdr.msg_name =
+                    const_cast<sockaddr_in *>(target);
+                out_msgs[i].msg_hdr.msg_namelen = sizeof(*target);
+            }
+        }
+
+        while (true) {
+            int got = ::recvmmsg(fd, in_msgs.data(), kBatch, MSG_WAITFORONE,
+                                 nullptr);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(system_error_message("recvmmsg"));
+            }
+
+            char *cursor = out_buffer.data();
+            char *limit = cursor + out_buffer.size();
+            unsigned ready = 0;
+            uint64_t dropped = truncated_ + no_room_;
+            for (int i = 0; i < got; ++i) {
+                std::string_view datagram(
+                    static_cast<const char *>(in_iov[i].iov_base),
+                    in_msgs[i].msg_len);
+                if (in_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                    // Longer than kDatagram: the last line is cut short
+                    // and would read as a different value.
+                    datagram = datagram.substr(0, datagram.rfind('\n') + 1);
+                    ++truncated_;
+                }
+                char *end = convert_datagram(datagram, cursor, limit);
+                if (end != cursor) {
+                    out_iov[ready++] = {cursor,
+                                        static_cast<size_t>(end - cursor)};
+                }
+                cursor = end;
+            }
+
+            if (target != nullptr) {
+                for (unsigned sent = 0; sent < ready;) {
+                    int n = ::sendmmsg(fd, out_msgs.data() + sent,
+                                       ready - sent, 0);
+                    if (n <= 0) {
+                        break; // drop the rest rather than stall intake
+                    }
+                    sent += static_cast<unsigned>(n);
+                }
+            } else if (cursor != out_buffer.data()) {
+                // One write per batch keeps concurrent sockets' lines whole.
+                std::fwrite(out_buffer.data(), 1,
+                            static_cast<size_t>(cursor - out_buffer.data()),
+                            out);
+                std::fflush(out);
+            }
+            if (truncated_ + no_room_ != dropped) {
+                report_drops();
+            }
+        }
+    }
+
+    std::vector<ChannelPlan> channels_;
+    std::optional<ConversionPlan> fallback_;
+
+    std::atomic<uint64_t> truncated_{0}; // datagrams cut at kDatagram
+    std::atomic<uint64_t> no_room_{0};   // readings past the output buffer
+    std::atomic<int64_t> last_report_{0};
+};
+
+// Writes `value` rounded to `decimals` places (at most 9) with integer
+// arithmetic, which is several times cheaper than general formatting.
+// Values whose scaled form does not fit in 63 bits go through to_chars.
+char *format_fixed(char *out, char *limit, double value, int decimals) {
+    static constexpr double kPow10[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                        1e5, 1e6, 1e7, 1e8, 1e9};
+    double scaled = std::round(std::fabs(value) * kPow10[decimals]);
+    if (!(scaled < 9.2e18)) {
+        return std::to_chars(out, limit, value, std::chars_format::fixed,
+                             decimals)
+            .ptr;
+    }
+
+    auto digits = static_cast<uint64_t>(scaled);
+    char buffer[24];
+    char *p = buffer + sizeof(buffer);
+    for (int d = 0; d < decimals; ++d) {
+        *--p = static_cast<char>('0' + digits % 10);
+        digits /= 10;
+    }
+    if (decimals > 0) {
+        *--p = '.';
+    }
+    do {
+        *--p = static_cast<char>('0' + digits % 10);
+        digits /= 10;
+    } while (digits > 0);
+    if (value < 0 && scaled != 0) {
+        *--p = '-';
+    }
+    return std::copy(p, buffer + sizeof(buffer), out);
+}
+
+// Digits after the decimal point in a number as written, e.g. 2 for "0.01".
+int decimals_in(const std::string &text) {
+    size_t dot = text.find('.');
+    if (dot == std::string::npos) {
+        return 0;
+    }
+    size_t end = text.find_first_not_of("0123456789", dot + 1);
+    return static_cast<int>(
+        (end == std::string::npos ? text.size() : end) - dot - 1);
+}
+
+// --range START:STOP:STEP, as written and as numbers.
+struct RangeSpec {
+    double start{0.0};
+    double stop{0.0};
+    double step{0.0};
+    int decimals{0};
+};
+
+RangeSpec parse_range(const std::string &text) {
+    size_t first = text.find(':');
+    size_t second = text.find(':', first == std::string::npos ? 0 : first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+        throw std::invalid_argument("'--range' expects START:STOP:STEP.");
+    }
+    std::string start = text.substr(0, first);
+    std::string stop = text.substr(first + 1, second - first - 1);
+    std::string step = text.substr(second + 1);
+
+    RangeSpec range;
+    range.start = std::stod(start);
+    range.stop = std::stod(stop);
+    range.step = std::stod(step);
+    range.decimals = std::min(9, std::max(decimals_in(start),
+                                          decimals_in(step)));
+    if (range.step == 0.0 || (range.stop - range.start) / range.step < 0) {
+        throw std::invalid_argument(
+            "'--range' step must move from START toward STOP.");
+    }
+    return range;
+}
+
+// Prints a conversion table: the source value and its conversion into
+// every target, one row per step. Row i is computed as start + i * step
+// (so error never accumulates), a block of rows is converted into every
+// target in straight loops the compiler vectorizes, and the rows are
+// formatted into one large buffer that is written in big pieces.
+void print_range_table(const RangeSpec &range, const std::string &from_unit,
+                       const std::vector<std::string> &to_units,
+                       int target_decimals, std::FILE *out) {
+    constexpr size_t kBlock = 1024;
+
+    std::vector<ConversionPlan> plans;
+    for (const auto &to : to_units) {
+        plans.push_back(make_plan(from_unit, to));
+    }
+
+    // Tolerate the rounding in (stop - start) / step, e.g. 0.3 / 0.1. An
+    // infinite or absurd count is refused before it is cast.
+    constexpr double kMaxRows = 1e9;
+    double row_count =
+        std::floor((range.stop - range.start) / range.step + 1e-9) + 1;
+    if (!std::isfinite(row_count) || row_count > kMaxRows) {
+        throw std::invalid_argument(
+            "'--range' needs finite values and at most a billion rows.");
+    }
+    auto rows = static_cast<uint64_t>(row_count);
+
+    std::string header = from_unit;
+    for (const auto &to : to_units) {
+        header += '\t' + to;
+    }
+    header += '\n';
+    std::fwrite(header.data(), 1, header.size(), out);
+
+    // The longest cell is DBL_MAX in fixed notation with 9 decimals: 309
+    // digits, a sign and a point. Budget that plus a separator per cell so
+    // a row never runs out of room, however large the values are.
+    constexpr size_t kCellBytes =
+        std::numeric_limits<double>::max_exponent10 + 1 + 2 + 9 + 1;
+    size_t row_bytes = kCellBytes * (plans.size() + 1);
+
+    std::vector<double> source(kBlock);
+    std::vector<double> converted(kBlock * plans.size());
+    std::vector<char> buffer(std::max<size_t>(1 << 20, 2 * row_bytes));
+    char *cursor = buffer.data();
+    char *limit = buffer.data() + buffer.size();
+    auto put = [&](char ch) {
+        if (cursor == limit) {
+            throw std::length_error("Range table row overflow");
+        }
+        *cursor++ = ch;
+    };
+
+    for (uint64_t base = 0; base < rows; base += kBlock) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(kBlock, rows - base));
+        for (size_t i = 0; i < n; ++i) {
+            source[i] =
+                range.start + static_cast<double>(base + i) * range.step;
+        }
+        for (size_t t = 0; t < plans.size(); ++t) {
+            const double scale = plans[t].scale;
+            const double offset = plans[t].offset;
+            double *column = converted.data() + t * kBlock;
+            for (size_t i = 0; i < n; ++i) {
+                column[i] = source[i] * scale + offset;
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if (static_cast<size_t>(limit - cursor) < row_bytes) {
+                std::fwrite(buffer.data(), 1,
+                            static_cast<size_t>(cursor - buffer.data()), out);
+                cursor = buffer.data();
+            }
+            cursor = format_fixed(cursor, limit, source[i], range.decimals);
+            for (size_t t = 0; t < plans.size(); ++t) {
+                put('\t');
+                double value = converted[t * kBlock + i];
+                cursor = target_decimals >= 0
+                             ? format_fixed(cursor, limit, value,
+                                            target_decimals)
+                             : std::to_chars(cursor, limit, value,
+                                             std::chars_format::general, 6)
+                                   .ptr;
+            }
+            put('\n');
+        }
+    }
+    std::fwrite(buffer.data(), 1, static_cast<size_t>(cursor - buffer.data()),
+                out);
+}
+
+// `--all`: converts each value into every unit of the source's category.
+// The per-target plans form an affine map, so a batch of values becomes one
+// small dense (targets x values) product. Lowercase spellings that only
+// alias another unit ("l" for "L") are left out, and rows come smallest
+// unit to largest.
+void print_all_units(const std::string &from_unit,
+                     const std::vector<double> &values) {
+    UnitCategory category = get_unit_category(from_unit);
+    if (category == UnitCategory::Unknown) {
+        throw std::runtime_error("Category unknown");
+    }
+
+    std::vector<std::string> units = units_by_size(category);
+    std::vector<std::string> targets;
+    std::vector<double> scales, offsets;
+    for (const auto &unit : units) {
+        bool alias = std::any_of(
+            units.begin(), units.end(), [&](const std::string &other) {
+                return other != unit && to_lower(other) == unit &&
+                       convert(other, unit, 1.0) == 1.0;
+            });
+        if (alias) {
+            continue;
+        }
+        ConversionPlan plan = make_plan(from_unit, unit);
+        targets.push_back(unit);
+        scales.push_back(plan.scale);
+        offsets.push_back(plan.offset);
+    }
+
+    size_t rows = targets.size(), cols = values.size();
+    std::vector<double> result(rows * cols);
+    for (size_t r = 0; r < rows; ++r) {
+        const double scale = scales[r];
+        const double offset = offsets[r];
+        double *row = result.data() + r * cols;
+        for (size_t c = 0; c < cols; ++c) {
+            row[c] = values[c] * scale + offset;
+        }
+    }
+
+    std::string output;
+    for (size_t r = 0; r < rows; ++r) {
+        output += targets[r];
+        for (size_t c = 0; c < cols; ++c) {
+            output += '\t';
+            append_number(output, result[r * cols + c]);
+        }
+        output += '\n';
+    }
+    std::fwrite(output.data(), 1, output.size(), stdout);
+}
+
+// `--repl`: answers one query per input line until EOF or "quit". A query
+// is a number (with -f/-t), a quantity ("5 ft 3 in", with -t) or an
+// expression ("3 km + 200 m in ft"). Plans stay in `registry` for the whole
+// session, so a repeated question never goes back to the unit maps. Each
+// non-empty line gets exactly one line back, an error included, and output
+// is flushed per answer so another program can drive this as a coprocess.
+void run_repl(const Args &args, std::FILE *in, std::FILE *out) {
+    bool interactive = ::isatty(::fileno(in)) && ::isatty(::fileno(out));
+    PlanRegistry registry;
+    std::optional<PlanCache> quantities;
+    std::optional<ConversionPlan> bare;
+    if (!args.to_unit.empty()) {
+        quantities.emplace(args.to_unit);
+        if (!args.from_unit.empty()) {
+            bare = make_plan(args.from_unit, args.to_unit);
+        }
+    }
+
+    std::string answer;
+    char *line = nullptr;
+    size_t capacity = 0;
+    while (true) {
+        if (interactive) {
+            std::fputs("> ", out);
+            std::fflush(out);
+        }
+        ssize_t got = ::getline(&line, &capacity, in);
+        if (got < 0) {
+            break;
+        }
+        std::string_view query(line, static_cast<size_t>(got));
+        while (!query.empty() && std::isspace(static_cast<unsigned char>(
+                                     query.back()))) {
+            query.remove_suffix(1);
+        }
+        while (!query.empty() && std::isspace(static_cast<unsigned char>(
+                                     query.front()))) {
+            query.remove_prefix(1);
+        }
+        if (query.empty()) {
+            continue;
+        }
+        if (query == "quit" || query == "exit") {
+            break;
+        }
+
+        answer.clear();
+        Expected<double> value =
+            quantities ? parse_quantity(query, *quantities,
+                                        bare ? &*bare : nullptr)
+                       : Expected<double>(ConvertFailure{});
+        if (value) {
+            append_number(answer, *value);
+            answer += ' ';
+            answer += args.to_unit;
+        } else {
+            try {
+                ExpressionProgram program =
+                    compile_expression(query, args.to_unit, &registry);
+                if (!program.terms.empty()) {
+                    throw std::invalid_argument("'$N' columns only work on "
+                                                "rows.");
+                }
+                append_number(answer, program.constant);
+                if (!program.unit.empty()) {
+                    answer += ' ';
+                    answer += program.unit;
+                }
+            } catch (const std::exception &e) {
+                answer = "error: ";
+                answer += e.what();
+            }
+        }
+        answer += '\n';
+        std::fwrite(answer.data(), 1, answer.size(), out);
+        std::fflush(out);
+    }
+    std::free(line);
+}
+
+// Batch settings that --autotune found fastest on this machine. Later runs
+// load them for whatever the command line leaves unset.
+struct MachineProfile {
+    unsigned jobs{0};
+    size_t batch_round{0}; // bytes; 0 = one round
+    std::string cpu{"auto"};
+
+    std::string serialize() const {
+        return "xcvt-profile 1\njobs " + std::to_string(jobs) +
+               "\nbatch-round " + std::to_string(batch_round) + "\ncpu " +
+               cpu + "\n";
+    }
+
+    // A missing profile is normal; a broken one is only worth a warning,
+    // since the defaults still work.
+    static std::optional<MachineProfile> load(const std::string &path) {
+        if (::access(path.c_str(), F_OK) != 0) {
+            return std::nullopt;
+        }
+        std::ifstream in(path);
+        MachineProfile profile;
+        std::string magic, version, tag;
+        in >> magic >> version >> tag >> profile.jobs >> tag >>
+            profile.batch_round >> tag >> profile.cpu;
+        if (!in || magic != "xcvt-profile" || version != "1") {
+            std::cerr << "Ignoring " << path << ": not a readable profile; "
+                      << "rerun 'xcvt --autotune'.\n";
+            return std::nullopt;
+        }
+        return profile;
+    }
+};
+
+// One file per host, so a home directory shared across machines keeps each
+// machine's own numbers. Empty when there is nowhere to keep it.
+std::string profile_path() {
+    const char *config = std::getenv("XDG_CONFIG_HOME");
+    const char *home = std::getenv("HOME");
+    std::string dir;
+    if (config && *config) {
+        dir = config;
+    } else if (home && *home) {
+        dir = std::string(home) + "/.config";
+    } else {
+        return "";
+    }
+    char host[256] = {};
+    ::gethostname(host, sizeof(host) - 1);
+    return dir + "/xcvt/" + host + ".profile";
+}
+
+// Fills in what the command line left unset from this machine's profile.
+// Jobs are capped by the current budget, in case the cgroup has shrunk, and
+// kernels this CPU lacks (a profile copied from elsewhere) are left at auto.
+void apply_profile(Args &args) {
+    std::string path = profile_path();
+    std::optional<MachineProfile> profile =
+        path.empty() ? std::nullopt : MachineProfile::load(path);
+    if (!profile) {
+        return;
+    }
+    if (args.jobs == 0) {
+        args.jobs = std::min(profile->jobs, machine_budget().cpus);
+    }
+    if (args.batch_round == 0) {
+        args.batch_round = profile->batch_round;
+    }
+    if (args.cpu == "auto") {
+        for (const Kernels *candidate : supported_kernels()) {
+            if (profile->cpu == candidate->name) {
+                args.cpu = profile->cpu;
+            }
+        }
+    }
+}
+
+// Round size for plain batch runs: as asked, or else a quarter of the
+// cgroup memory limit so the output buffers fit under it.
+size_t batch_round(const Args &args) {
+    if (args.batch_round > 0) {
+        return args.batch_round;
+    }
+    return static_cast<size_t>(machine_budget().memory / 4);
+}
+
+// `xcvt --autotune`: times batch conversion of a sample of the input (the
+// first 32 MB of rows) under candidate settings and saves the fastest as
+// this machine's profile. Settings are searched one at a time, keeping the
+// best of the others: worker count, then round size, then kernels (which
+// only records and templates use). Each point is the best of three runs,
+// and a candidate only wins by more than 2%, so ties go to the smaller
+// setting.
+void run_autotune(const Args &args) {
+    constexpr size_t kSample = 32 << 20;
+    constexpr int kTrials = 3;
+
+    InputData input(args.input_path, args.shard);
+    std::string_view data = input.data();
+    if (data.size() > kSample) {
+        size_t cut = data.find(args.layout.separator, kSample - 1);
+        data = data.substr(0, cut == std::string_view::npos ? data.size()
+                                                            : cut + 1);
+    }
+    if (data.empty()) {
+        throw std::runtime_error("'--autotune' needs sample rows.");
+    }
+
+    const MachineBudget &budget = machine_budget();
+    std::cerr << "Tuning on " << data.size() / 1024 << " KB of rows, "
+              << budget.cpus << " CPU(s)";
+    if (budget.memory > 0) {
+        std::cerr << ", " << (budget.memory >> 20) << " MB memory limit";
+    }
+    std::cerr << "\n";
+
+    FileHandle sink(std::fopen("/dev/null", "wb"));
+    if (!sink) {
+        throw std::runtime_error(system_error_message("Cannot open "
+                                                      "/dev/null"));
+    }
+    auto measure = [&](const MachineProfile &profile) {
+        bind_kernels(profile.cpu);
+        size_t round = profile.batch_round > 0
+                           ? profile.batch_round
+                           : static_cast<size_t>(budget.memory / 4);
+        double best = std::numeric_limits<double>::infinity();
+        for (int trial = 0; trial < kTrials; ++trial) {
+            RowErrors errors;
+            auto start = std::chrono::steady_clock::now();
+            convert_in_rounds(args.from_unit, args.to_unit, args.layout,
+                              data, profile.jobs, round, sink.get(), errors);
+            std::chrono::duration<double> took =
+                std::chrono::steady_clock::now() - start;
+            best = std::min(best, took.count());
+        }
+        double rate = static_cast<double>(data.size()) / (1 << 20) / best;
+        std::cerr << "  jobs " << profile.jobs << ", rounds "
+                  << (profile.batch_round > 0
+                          ? std::to_string(profile.batch_round >> 20) + " MB"
+                          : std::string("whole"))
+                  << ", kernels " << kernels->name << ": "
+                  << static_cast<long>(rate) << " MB/s\n";
+        return rate;
+    };
+
+    MachineProfile best;
+    best.jobs = 1;
+    double best_rate = measure(best);
+    auto consider = [&](const MachineProfile &candidate) {
+        double rate = measure(candidate);
+        if (rate > best_rate * 1.02) {
+            best = candidate;
+            best_rate = rate;
+        }
+    };
+
+    for (unsigned jobs = 2; jobs < budget.cpus * 2; jobs *= 2) {
+        MachineProfile candidate = best;
+        candidate.jobs = std::min(jobs, budget.cpus);
+        consider(candidate);
+    }
+    for (size_t mb : {1, 4, 16}) {
+        if ((mb << 20) < data.size()) {
+            MachineProfile candidate = best;
+            candidate.batch_round = mb << 20;
+            consider(candidate);
+        }
+    }
+    if (args.layout.records || !args.layout.expression.empty()) {
+        for (const Kernels *level : supported_kernels()) {
+            MachineProfile candidate = best;
+            candidate.cpu = level->name;
+            consider(candidate);
+        }
+    }
+
+    std::string path = profile_path();
+    if (path.empty()) {
+        throw std::runtime_error("Nowhere to save the profile: set HOME or "
+                                 "XDG_CONFIG_HOME.");
+    }
+    std::string dir = path.substr(0, path.rfind('/'));
+    std::string parent = dir.substr(0, dir.rfind('/'));
+    if ((::mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) ||
+        (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)) {
+        throw std::runtime_error(system_error_message("Cannot create " +
+                                                      dir));
+    }
+    write_file_atomically(path, best.serialize());
+    std::cout << "Saved " << path << ": jobs " << best.jobs << ", rounds "
+              << (best.batch_round > 0
+                      ? std::to_string(best.batch_round >> 20) + " MB"
+                      : std::string("whole"))
+              << ", kernels " << best.cpu << "\n";
+}
+
+void print_stream_stats(const StreamSketch &sketch,
+                        const std::vector<double> &quantiles,
+                        bool show_histogram, std::ostream &out) {
+    out << "Unit: " << sketch.unit << "\n"
+        << "Count: " << sketch.count << "\n";
+    if (sketch.count == 0) {
+        return;
+    }
+
+    out << "Sum: " << sketch.sum << "\n"
+        << "Mean: " << sketch.sum / static_cast<double>(sketch.count) << "\n"
+        << "Min: " << sketch.min << "\n"
+        << "Max: " << sketch.max << "\n";
+    for (double q : quantiles) {
+        out << "p" << q * 100 << ": " << sketch.quantile(q) << "\n";
+    }
+
+    if (show_histogram) {
+        out << "Histogram:\n";
+        sketch.histogram.print(out);
+    }
+}
+
+void print_units() {
+    std::cout << "Supported units:\n\n";
+
+    const std::pair<const char *, UnitCategory> categories[] = {
+        {"Length", UnitCategory::Length},
+        {"Mass", UnitCategory::Mass},
+        {"Volume", UnitCategory::Volume},
+        {"Temperature", UnitCategory::Tempurature},
+    };
+    for (const auto &[name, category] : categories) {
+        std::cout << (category == UnitCategory::Length ? "" : "\n\n")
+                  << name << ":\n  ";
+        for (const auto &unit : units_by_size(category)) {
+            std::cout << unit << "  ";
+        }
+    }
+    std::cout << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        Args args = parse_args(argc, argv);
+        if (args.batch && !args.autotune) {
+            apply_profile(args);
+        }
+        bind_kernels(args.cpu);
+
+        if (args.show_help) {
+            print_usage();
+            std::cout << "For a list of units, use the -l or --list flag.\n";
+            return 0;
+        }
+
+        if (args.list_units) {
+            print_units();
+            return 0;
+        }
+
+        if (args.show_version) {
+            std::cout << "Current Version:\t\033[1;32m" << PROGRAM_VERSION
+                      << "\033[0m\n"
+                      << "Kernels:\t\t" << kernels->name << "\n";
+            return 0;
+        }
+
+        if (args.repl) {
+            run_repl(args, stdin, stdout);
+            return 0;
+        }
+
+        std::string from_label = args.from_unit;
+        if (!args.quantities.empty()) {
+            // Read them in -f's unit, or straight into -t's without one;
+            // only with -f may they be bare numbers ("1,234.5"). Anything
+            // else is an expression, which may name the unit itself.
+            std::string base =
+                args.from_unit.empty() ? args.to_unit : args.from_unit;
+            std::optional<ConversionPlan> bare;
+            if (!args.from_unit.empty()) {
+                bare = make_plan(args.from_unit, args.from_unit);
+            }
+            std::optional<PlanCache> plans;
+            for (const auto &[index, text] : args.quantities) {
+                double &value = args.values[index];
+                // The first value's own units, for the "From:" line.
+                std::string *units =
+                    index == 0 && args.from_unit.empty() ? &from_label
+                                                         : nullptr;
+                if (!base.empty()) {
+                    if (!plans) {
+                        plans.emplace(base);
+                    }
+                    if (units != nullptr) {
+                        units->clear();
+                    }
+                    Expected<double> parsed = parse_quantity(
+                        text, *plans, bare ? &*bare : nullptr, units);
+                    if (parsed) {
+                        value = *parsed;
+                        continue;
+                    }
+                }
+                ExpressionProgram expression = compile_expression(text, base);
+                if (expression.unit.empty()) {
+                    throw std::invalid_argument("'" + text +
+                                                "' has no unit.");
+                }
+                if (base.empty()) {
+                    base = expression.unit;
+                }
+                if (units != nullptr) {
+                    *units = expression.unit;
+                }
+                value = convert(expression.unit, base, expression.constant);
+            }
+            // Values are already in `base`, so that is what they convert
+            // from.
+            if (args.from_unit.empty()) {
+                args.from_unit = base;
+            }
+            if (from_label.empty()) {
+                from_label = base;
+            }
+            if (args.to_unit.empty()) {
+                args.to_unit = base;
+                args.to_units.push_back(base);
+            }
+        }
+
+        if (args.all_units) {
+            print_all_units(args.from_unit, args.values);
+            return 0;
+        }
+
+        if (!args.range.empty()) {
+            FileHandle file;
+            std::FILE *out = open_output(args.output_path, file);
+            print_range_table(parse_range(args.range), args.from_unit,
+                              args.to_units, args.fixed_decimals, out);
+            if (std::fflush(out) != 0) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.udp_port > 0) {
+            std::vector<ChannelPlan> channels;
+            for (const auto &spec : args.channels) {
+                channels.push_back(parse_channel(spec));
+            }
+            std::optional<ConversionPlan> fallback;
+            if (!args.from_unit.empty() && !args.to_unit.empty()) {
+                fallback = make_plan(args.from_unit, args.to_unit);
+            }
+
+            FileHandle file;
+            std::FILE *out = open_output(args.output_path, file);
+            UdpConverter(std::move(channels), std::move(fallback))
+                .run(static_cast<uint16_t>(args.udp_port), args.udp_sockets,
+                     args.forward, out);
+        }
+
+        if (args.write_index) {
+            write_line_index(args.input_path, 1 << 16);
+            return 0;
+        }
+
+        if (args.merge_mode == "concat") {
+            FileHandle file;
+            std::FILE *out = open_output(args.output_path, file);
+            merge_concat(args.merge_files, out);
+            if (std::fflush(out) != 0) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.merge_mode == "spool") {
+            if (args.merge_files.size() != 1) {
+                throw std::runtime_error(
+                    "'--merge spool' takes one spool directory.");
+            }
+            FileHandle file;
+            std::FILE *out = open_output(args.output_path, file);
+            merge_spool(args.merge_files[0], out);
+            if (std::fflush(out) != 0) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.merge_mode == "groups") {
+            std::ofstream file;
+            if (!args.output_path.empty()) {
+                file.open(args.output_path);
+            }
+            merge_groups(args.merge_files,
+                         args.output_path.empty() ? std::cout : file);
+            return 0;
+        }
+
+        if (args.merge_mode == "sketches") {
+            StreamSketch sketch;
+            for (const auto &path : args.merge_files) {
+                sketch.merge(StreamSketch::load(path));
+            }
+            print_stream_stats(sketch, args.quantiles, args.show_histogram,
+                               std::cout);
+            if (!args.sketch_out.empty()) {
+                sketch.save(args.sketch_out);
+            }
+            return 0;
+        }
+
+        if (!args.follow_path.empty()) {
+            std::ios::sync_with_stdio(false);
+            LineConverter converter(args.from_unit, args.to_unit,
+                                    args.layout);
+            FileFollower(args.follow_path, args.state_path, converter,
+                         std::cout, args.layout)
+                .run();
+        }
+
+        if (args.window.size > 0.0) {
+            std::ios::sync_with_stdio(false);
+            std::ifstream in_file;
+            if (!args.input_path.empty()) {
+                in_file.open(args.input_path);
+                if (!in_file) {
+                    throw std::runtime_error(system_error_message(
+                        "Cannot read " + args.input_path));
+                }
+            }
+            std::ofstream out_file;
+            if (!args.output_path.empty()) {
+                out_file.open(args.output_path);
+                if (!out_file) {
+                    throw std::runtime_error(system_error_message(
+                        "Cannot write " + args.output_path));
+                }
+            }
+            std::ostream &out =
+                args.output_path.empty() ? std::cout : out_file;
+            window_stream(args.from_unit, args.to_unit, args.layout,
+                          args.window,
+                          args.input_path.empty() ? std::cin : in_file, out);
+            if (!out.flush()) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.stats || args.layout.group_col > 0) {
+            std::ofstream file;
+            if (!args.output_path.empty()) {
+                file.open(args.output_path);
+                if (!file) {
+                    throw std::runtime_error(system_error_message(
+                        "Cannot write " + args.output_path));
+                }
+            }
+            std::ostream &out = args.output_path.empty() ? std::cout : file;
+
+            StreamSketch sketch;
+            if (!args.to_unit.empty() &&
+                (!args.from_unit.empty() || args.layout.unit_col > 0 ||
+                 args.sketch_in.empty())) {
+                AggregateOptions options;
+                options.layout = args.layout;
+                options.stats = args.stats;
+                options.groups = args.layout.group_col > 0;
+                options.spill_groups = args.spill_groups;
+                options.jobs = worker_count(args.jobs);
+
+                InputData input(args.input_path, args.shard);
+                RowErrors errors;
+                sketch = aggregate_stream(args.from_unit, args.to_unit,
+                                          input.data(), options, errors, out);
+                errors.report(std::cerr);
+            }
+            if (args.stats) {
+                for (const auto &path : args.sketch_in) {
+                    sketch.merge(StreamSketch::load(path));
+                }
+                print_stream_stats(sketch, args.quantiles,
+                                   args.show_histogram, out);
+                if (!args.sketch_out.empty()) {
+                    sketch.save(args.sketch_out);
+                }
+            }
+            if (!out.flush()) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.autotune) {
+            run_autotune(args);
+            return 0;
+        }
+
+        if (args.batch && !args.recursive_dir.empty()) {
+            TreeConverter tree(args.from_unit, args.to_unit, args.layout);
+            size_t failed = tree.run(args.recursive_dir, args.output_path,
+                                     worker_count(args.jobs));
+            if (!args.reject_path.empty()) {
+                write_file_atomically(args.reject_path,
+                                      tree.row_errors().rejected);
+            }
+            return failed == 0 ? 0 : 1;
+        }
+
+        if (args.batch && !args.spool_dir.empty()) {
+            SpoolWorker(args.spool_dir, args.lease_seconds)
+                .run(args.from_unit, args.to_unit, args.layout,
+                     args.input_path, args.chunk_size,
+                     worker_count(args.jobs));
+            return 0;
+        }
+
+        if (args.batch && args.checkpoint) {
+            RowErrors errors;
+            convert_with_checkpoints(
+                args.from_unit, args.to_unit, args.layout, args.input_path,
+                args.output_path, args.output_path + ".ckpt",
+                args.checkpoint_interval, args.resume,
+                worker_count(args.jobs), errors);
+            errors.report(std::cerr, args.layout.on_error);
+            return 0;
+        }
+
+        if (args.batch) {
+            InputData input(args.input_path, args.shard);
+            std::string_view data = input.data();
+
+            FileHandle file;
+            std::FILE *out = open_output(args.output_path, file);
+
+            RowErrors errors;
+            if (!args.cache_dir.empty()) {
+                convert_with_cache(args.from_unit, args.to_unit, args.layout,
+                                   data, args.cache_dir,
+                                   worker_count(args.jobs), out, errors);
+            } else {
+                convert_in_rounds(args.from_unit, args.to_unit, args.layout,
+                                  data, worker_count(args.jobs),
+                                  batch_round(args), out, errors);
+            }
+            errors.report(std::cerr, args.layout.on_error);
+            if (!args.reject_path.empty()) {
+                write_file_atomically(args.reject_path, errors.rejected);
+            }
+            if (std::fflush(out) != 0) {
+                throw std::runtime_error("Write failed");
+            }
+            return 0;
+        }
+
+        if (args.from_unit == "" || args.to_unit == "") {
+            print_usage();
+            return 1;
+        }
+
+        if (args.values.size() > 1 ||
+            args.layout.format != OutputFormat::Text) {
+            // Many values: one plan, one pass, one record per value.
+            ConversionPlan plan = make_plan(args.from_unit, args.to_unit);
+            std::string output;
+            output.reserve(args.values.size() * 12);
+            std::visit(
+                [&](const auto &writer) {
+                    for (double value : args.values) {
+                        writer.write(output, plan.apply(value),
+                                     args.to_unit);
+                    }
+                },
+                make_row_writer(args.layout, args.to_unit));
+            std::fwrite(output.data(), 1, output.size(), stdout);
+            return 0;
+        }
+
+        double result =
+            convert(args.from_unit, args.to_unit, args.values.front());
+        if (args.layout.auto_scale) {
+            AutoScale auto_scale(args.to_unit);
+            size_t rung = auto_scale.pick(result);
+            result = auto_scale.scale(result, rung);
+            args.to_unit = auto_scale.unit(rung);
+        }
+
+        // Print out values, highlighted only for a terminal.
+        bool tty = ::isatty(STDOUT_FILENO);
+        if (!args.layout.split.empty()) {
+            std::string parts;
+            SplitFormat(args.to_unit, args.layout.split).append(parts, result);
+            std::cout << "From: " << from_label << "\n"
+                      << "To: " << args.layout.split << "\n"
+                      << "Value: " << (tty ? "\033[1;32m" : "") << parts
+                      << (tty ? "\033[0m" : "") << "\n";
+            return 0;
+        }
+        std::cout << "From: " << from_label << "\n"
                   << "To: " << args.to_unit << "\n"
-                  << "Value: \033[1;32m" << result << args.to_unit
-                  << "\033[0m\n";
+                  << "Value: " << (tty ? "\033[1;32m" : "") << result
+                  << args.to_unit << (tty ? "\033[0m" : "") << "\n";
 
         return 0;
     } catch (const std::exception &e) {